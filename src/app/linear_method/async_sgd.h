@@ -13,6 +13,7 @@
 #include "app/linear_method/proto/linear.pb.h"
 #include "app/linear_method/loss.h"
 #include "app/linear_method/penalty.h"
+#include "app/linear_method/sgd_kernel.h"
 namespace PS {
 namespace LM {
 
@@ -46,18 +47,18 @@ class AsyncSGDServer : public ISGDCompNode {
       : ISGDCompNode(), conf_(conf) {
     SGDState state(conf_.penalty(), conf_.learning_rate());
     state.reporter = &(this->reporter_);
+    SGDKernel<V> kernel(conf_.learning_rate(), conf_.penalty());
     if (conf_.async_sgd().algo() == SGDConfig::FTRL) {
-      auto model = new KVMap<Key, V, FTRLEntry, SGDState>();
-      model->set_state(state);
-      model_ = model;
+      model_ = new Model(true, state, kernel);
     } else {
       if (conf_.async_sgd().ada_grad()) {
-        model_ = new KVMap<Key, V, AdaGradEntry, SGDState>();
+        model_ = new Model(false, state, kernel);
       } else {
         CHECK(false);
       //   model_ = new KVStore<Key, V, AdaGradEntry<V>, SGDState<V>>();
       }
     }
+    LoadModel();
   }
 
   virtual ~AsyncSGDServer() {
@@ -71,9 +72,25 @@ class AsyncSGDServer : public ISGDCompNode {
       std::string file = output.file(0) + "_" + MyNodeID();
       CHECK_NOTNULL(model_)->WriteToFile(file);
       LOG(INFO) << MyNodeID() << " written the model to " << file;
+    } else if (output.format() == DataConfig::BIN) {
+      CHECK(output.file_size());
+      std::string file = output.file(0) + "_" + MyNodeID();
+      CHECK_NOTNULL(model_)->SaveCheckpoint(file);
+      LOG(INFO) << MyNodeID() << " written the checkpoint to " << file;
     }
   }
 
+  // warm starts from the checkpoint in model_input, which is saved by the
+  // server with the same node id
+  void LoadModel() {
+    if (!conf_.has_model_input()) return;
+    auto input = conf_.model_input();
+    if (input.format() != DataConfig::BIN || !input.file_size()) return;
+    std::string file = input.file(0) + "_" + MyNodeID();
+    CHECK_NOTNULL(model_)->LoadCheckpoint(file);
+    LOG(INFO) << MyNodeID() << " loaded the checkpoint " << file;
+  }
+
   virtual void ProcessRequest(Message* request) {
     if (request->task.sgd().cmd() == SGDCall::SAVE_MODEL) {
       SaveModel();
@@ -103,6 +120,22 @@ class AsyncSGDServer : public ISGDCompNode {
       reporter->Report(prog);
     }
 
+    // a state for a thread updating entries, which shares the learning rate
+    // and the penalty but has its own statistics
+    SGDState Local() const {
+      SGDState local;
+      local.lr = lr; local.h = h;
+      return local;
+    }
+
+    // adds the statistics of "local" into this one
+    void Merge(const SGDState& local) {
+      // nnz is unsigned, the delta of a local one may wrap around
+      nnz += local.nnz;
+      weight_sum += local.weight_sum;
+      delta_sum += local.delta_sum;
+    }
+
     void UpdateWeight(V new_weight, V old_weight) {
       // LL << new_weight << " " << old_weight;
       if (new_weight == 0 && old_weight != 0) {
@@ -127,52 +160,209 @@ class AsyncSGDServer : public ISGDCompNode {
   };
 
   /**
-   * @brief An entry for FTRL
+   * @brief The entry of a key in Model, which is its position in the arrays
+   * plus 1, and 0 means a new key. The values are accessed by Model in batch
+   * rather than by Get and Set.
    */
-  struct FTRLEntry {
-    V w = 0;  // not necessary to store w, because it can be computed from z
-    V z = 0;
-    V sqrt_n = 0;
-
-    void Set(const V* data, void* state) {
-      SGDState* st = (SGDState*) state;
-      // update model
-      V w_old = w;
-      V grad = *data;
-      V sqrt_n_new = sqrt(sqrt_n * sqrt_n + grad * grad);
-      V sigma = (sqrt_n_new - sqrt_n) / st->lr->alpha();
-      z += grad  - sigma * w;
-      sqrt_n = sqrt_n_new;
-      V eta = st->lr->eval(sqrt_n);
-      w = st->h->proximal(-z*eta, eta);
-
-      // update status
-      st->UpdateWeight(w, w_old);
-    }
+  struct Position {
+    uint32 pos = 0;
+    void Get(V* data, void* state) { }
+    void Set(const V* data, void* state) { }
+  };
 
-    void Get(V* data, void* state) { *data = w; }
+  /**
+   * @brief The entry of a key in the replica of a Model, which is the weight,
+   * n and z of the key shipped last by the owner
+   */
+  struct Snapshot {
+    V value[3] = {0, 0, 0};
+    void Get(V* data, void* state) { std::copy(value, value + 3, data); }
+    void Set(const V* data, void* state) { std::copy(data, data + 3, value); }
   };
 
   /**
-   * @brief An entry for adaptive gradient
+   * @brief The model. The keys are mapped to positions in the arrays of the
+   * entries, and a push updates all its keys by a batched kernel.
+   *
+   * The replicas are not updated by replaying the gradients, which needs the
+   * kernel. Instead, a push logs the new weight, n and z of its keys, which
+   * replace the old ones on the replicas.
    */
-  struct AdaGradEntry {
-    void Set(const V* data, void* state) {
-      SGDState* st = (SGDState*) state;
-      // update model
-      V grad = *data;
-      sum_sq_grad += grad * grad;
-      V eta = st->lr->eval(sqrt(sum_sq_grad));
-      V w_old = weight;
-      weight = st->h->proximal(weight - eta * grad, eta);
-
-      // update status
-      st->UpdateWeight(weight, w_old);
+  class Model : public KVMap<Key, V, Position, SGDState, Snapshot> {
+   public:
+    Model(bool ftrl, const SGDState& state, const SGDKernel<V>& kernel)
+        : KVMap<Key, V, Position, SGDState, Snapshot>(3),
+          ftrl_(ftrl), kernel_(kernel) {
+      this->set_state(state);
+    }
+    virtual ~Model() { }
+
+    virtual void GetValue(Message* msg) {
+      auto pos = Find(SArray<Key>(msg->key));
+      SArray<V> val(pos.size());
+      for (size_t i = 0; i < pos.size(); ++i) val[i] = w_[pos[i]];
+      msg->add_value(val);
+    }
+
+    virtual void SetValue(const Message* msg) {
+      auto pos = Find(SArray<Key>(msg->key));
+      CHECK_EQ(msg->value.size(), 1);
+      SArray<V> grad(msg->value[0]);
+      CHECK_EQ(pos.size(), grad.size());
+
+      // the positions of a push are unique, so split them among threads. the
+      // pushes on different executor threads may share positions, so they
+      // are applied one by one
+      size_t n = pos.size();
+      int nt = (int)std::max((size_t)1, std::min(
+          (size_t)FLAGS_num_threads, n / 10000));
+      std::vector<typename SGDKernel<V>::Stat> stats(nt);
+      std::unique_lock<std::mutex> ul(update_mu_);
+      ParallelPool::instance().Run(nt, [this, &pos, &grad, &stats, n, nt](int t) {
+          SizeR r = SizeR(0, n).EvenDivide(nt, t);
+          if (ftrl_) {
+            kernel_.FTRL(pos.data() + r.begin(), grad.data() + r.begin(),
+                         r.size(), w_, z_, n_, &stats[t]);
+          } else {
+            kernel_.AdaGrad(pos.data() + r.begin(), grad.data() + r.begin(),
+                            r.size(), w_, n_, &stats[t]);
+          }
+        });
+      SArray<V> val;
+      if (this->logging()) {
+        val.resize(n * 3);
+        for (size_t i = 0; i < n; ++i) {
+          V* v = val.data() + i * 3;
+          v[0] = w_[pos[i]]; v[1] = n_[pos[i]]; v[2] = ftrl_ ? z_[pos[i]] : 0;
+        }
+      }
+      ul.unlock();
+
+      {
+        // requests on different executor threads share the state
+        Lock l(this->state_mu_);
+        auto& st = this->state_;
+        for (const auto& s : stats) {
+          st.nnz += s.nnz;
+          st.weight_sum += s.weight_sum;
+          st.delta_sum += s.delta_sum;
+        }
+        // update once per request, after all its chunks are applied
+        if (this->LastChunk(msg)) st.Update();
+      }
+
+      if (this->logging()) this->Log(SArray<Key>(msg->key), val);
+    }
+
+    virtual void Recover(Message* msg) {
+      SArray<Key> key(msg->key);
+      if (key.empty()) return;
+      CHECK_EQ(msg->value.size(), 1);
+      SArray<V> val(msg->value[0]);
+      CHECK_EQ(key.size() * 3, val.size());
+      Load(key, val.data(), 3);
+      LOG(INFO) << MyNodeID() << " recovered " << key.size() << " keys from "
+                << msg->sender;
+    }
+
+    virtual void WriteToFile(std::string file) {
+      if (!dirExists(getPath(file))) {
+        createDir(getPath(file));
+      }
+      std::ofstream out(file); CHECK(out.good());
+      ForEachEntry([this, &out](Key key, uint32 p) {
+          V v = w_[p];
+          if (v != 0) out << key << "\t" << v << std::endl;
+        });
+    }
+
+    // the values of a key are its weight, n and, for FTRL, z. so training
+    // can continue from a loaded checkpoint
+    virtual void SaveCheckpoint(std::string file) {
+      int k = ftrl_ ? 3 : 2;
+      // the model may get new keys during the walk, so the arrays grow with it
+      size_t m = this->data_.size();
+      SArray<Key> key; key.reserve(m);
+      SArray<V> val; val.reserve(m * k);
+      ForEachEntry([this, &key, &val](Key x, uint32 p) {
+          key.push_back(x);
+          val.push_back(w_[p]); val.push_back(n_[p]);
+          if (ftrl_) val.push_back(z_[p]);
+        });
+      SortKeyValue(&key, &val, k);
+      CheckpointWriter<Key, V> writer;
+      writer.Add(0, key, val, k);
+      CHECK(writer.Write(file));
     }
 
-    void Get(V* data, void* state) { *data = weight; }
-    V weight = 0;
-    V sum_sq_grad = 0;
+    virtual void LoadCheckpoint(std::string file) {
+      CheckpointReader<Key, V> reader;
+      CHECK(reader.Open(file));
+      for (int s = 0; s < reader.num_segments(); ++s) {
+        const auto& seg = reader.segment(s);
+        int k = ftrl_ ? 3 : 2;
+        CHECK_EQ(seg.k, k);
+        CHECK(seg.key) << "a dense checkpoint";
+        Load(SArray<Key>(const_cast<Key*>(seg.key), seg.n, false), seg.value, k);
+      }
+    }
+
+   private:
+    // sets the weight, n and z of key[i] by the k values starting at val[i*k]
+    void Load(const SArray<Key>& key, const V* val, int k) {
+      auto pos = Find(key);
+      Lock l(update_mu_);
+      for (size_t i = 0; i < pos.size(); ++i) {
+        const V* v = val + i * k;
+        w_[pos[i]] = v[0]; n_[pos[i]] = v[1];
+        if (ftrl_) z_[pos[i]] = v[2];
+      }
+    }
+
+    // calls func(key, position) for every key whose entries are reserved,
+    // with the updates paused, so the values of a key are consistent. pushes
+    // may still insert keys meanwhile, the ones not reserved yet have no
+    // updates and are skipped
+    template <typename F> void ForEachEntry(F func) {
+      Lock l(update_mu_);
+      size_t n = num_entries_;
+      w_.Reserve(n); n_.Reserve(n);
+      if (ftrl_) z_.Reserve(n);
+      this->data_.ForEach([&func, n](Key key, const Position& e) {
+          if (e.pos != 0 && e.pos <= n) func(key, e.pos - 1);
+        });
+    }
+
+    // returns the positions of "key" in the arrays, new keys are appended
+    SArray<uint32> Find(const SArray<Key>& key) {
+      SArray<uint32> pos(key.size());
+      this->Batch(key, [this, &pos](size_t i, Position* e, SGDState* st) {
+          if (e->pos == 0) {
+            size_t p = ++ num_entries_;
+            CHECK_LT(p, (size_t)kuint32max);
+            e->pos = (uint32)p;
+          }
+          pos[i] = e->pos - 1;
+        });
+      // covers the new positions of other threads too, whose keys may be
+      // found here before they reserve them
+      size_t n = num_entries_;
+      w_.Reserve(n); n_.Reserve(n);
+      if (ftrl_) z_.Reserve(n);
+      return pos;
+    }
+
+    bool ftrl_;
+    SGDKernel<V> kernel_;
+    std::atomic<size_t> num_entries_{0};
+    // the weights. the arrays grow while other executor threads are using
+    // them, so they are stored in chunks which never move
+    EntryArray<V> w_;
+    // FTRL: z and sqrt of n; AdaGrad: none and the sum of squared gradients
+    EntryArray<V> z_, n_;
+    // serializes the writes of the entries. a pull reads a weight without it,
+    // which may be updated meanwhile
+    std::mutex update_mu_;
   };
 
   // /**
@@ -235,7 +425,8 @@ class AsyncSGDWorker : public ISGDCompNode {
     reader.InitFilter(sgd.countmin_n(), sgd.countmin_k(), sgd.tail_feature_freq());
     reader.Start();
 
-    processed_batch_ = 0;
+    // finished once the gradient of a minibatch is pushed
+    std::vector<Future> pushed;
     int id = 0;
     SArray<Key> key;
     for (; ; ++id) {
@@ -249,10 +440,11 @@ class AsyncSGDWorker : public ISGDCompNode {
       // pull the weight
       auto req = Parameter::Request(id, -1, {}, sgd.pull_filter());
       model_[id].key = key;
-      model_.Pull(req, key, [this, id]() { ComputeGradient(id); });
+      pushed.push_back(model_.PullAsync(req, key).Then(
+          [this, id]() { return ComputeGradient(id); }));
     }
 
-    while (processed_batch_ < id) { usleep(500); }
+    Future::WhenAll(pushed).Wait();
     LOG(INFO) << MyNodeID() << ": finished workload " << load.id();
   }
 
@@ -260,8 +452,10 @@ class AsyncSGDWorker : public ISGDCompNode {
    * @brief Compute gradient
    *
    * @param id minibatch id
+   *
+   * @return the push of the gradient
    */
-  void ComputeGradient(int id) {
+  Future ComputeGradient(int id) {
     mu_.lock();
     auto Y = data_[id].first;
     auto X = data_[id].second;
@@ -291,8 +485,9 @@ class AsyncSGDWorker : public ISGDCompNode {
     auto req = Parameter::Request(id, -1, {}, conf_.async_sgd().push_filter());
     // grad.EigenArray() /= (V)Y->rows();
     // LL << grad;
-    model_.Push(req, model_[id].key, {grad}, [this](){ ++ processed_batch_; });
+    auto push = model_.PushAsync(req, model_[id].key, {grad});
     model_.Clear(id);
+    return push;
   }
 
 private:
@@ -303,7 +498,6 @@ private:
   std::unordered_map<int, std::pair<MatrixPtr<V>, MatrixPtr<V>>> data_;
 
   std::mutex mu_;
-  std::atomic_int processed_batch_;
   int workload_id_ = -1;
 
   Config conf_;
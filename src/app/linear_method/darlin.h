@@ -178,7 +178,9 @@ class DarlinCompNode {
 class DarlinServer : public BCDServer<Real>, public DarlinCompNode {
  public:
   DarlinServer(const Config& conf)
-      : BCDServer<Real>(conf.darlin()), conf_(conf) { }
+      : BCDServer<Real>(conf.darlin()), conf_(conf) {
+    if (conf_.has_model_input()) LoadModel(conf_.model_input());
+  }
   virtual ~DarlinServer() { }
 
  protected:
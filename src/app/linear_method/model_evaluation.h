@@ -2,6 +2,7 @@
 #include "system/customer.h"
 #include "data/stream_reader.h"
 #include "util/evaluation.h"
+#include "parameter/model_store.h"
 namespace PS {
 namespace LM {
 
@@ -17,18 +18,20 @@ class ModelEvaluation : public App {
 
 void ModelEvaluation::Run() {
   if (!IsScheduler()) return;
-  // load model
-  std::unordered_map<Key, Real> weight;
+  // load model, either text files or checkpoints written by servers
+  ModelStore<Key, Real> weight;
   auto model = searchFiles(conf_.model_input());
   NOTICE("find %d model files", model.file_size());
   for (int i = 0; i < model.file_size(); ++i) {
-    std::ifstream in(model.file(i));
-    while (in.good()) {
-      Key k; Real v;
-      in >> k >> v;
-      weight[k] = v;
+    if (model.format() == DataConfig::BIN) {
+      CHECK(weight.AddCheckpoint(model.file(i)));
+      continue;
     }
+    std::ifstream in(model.file(i));
+    Key k; Real v;
+    while (in >> k >> v) weight.Add(k, v);
   }
+  weight.Build();
 
   NOTICE("load %lu model entries", weight.size());
 
@@ -50,14 +53,14 @@ void ModelEvaluation::Run() {
 
     SArray<Real> Xw(mat[1]->rows()); Xw.SetZero();
     auto X = std::static_pointer_cast<SparseMatrix<Key, Real>>(mat[1]);
+    // look up the weights of all the entries in a batch
+    auto index = X->index();
+    SArray<Real> w(index.size());
+    weight.Get(index.data(), index.size(), w.data());
     for (int i = 0; i < X->rows(); ++i) {
       Real re = 0;
       for (size_t j = X->offset()[i]; j < X->offset()[i+1]; ++j) {
-        // TODO build a bloom filter
-        auto it = weight.find(X->index()[j]);
-        if (it != weight.end()) {
-          re += it->second * (X->binary() ? 1 : X->value()[j]);
-        }
+        re += w[j] * (X->binary() ? 1 : X->value()[j]);
       }
       Xw[i] = re;
     }
@@ -0,0 +1,361 @@
+#pragma once
+#include <atomic>
+#include <cmath>
+#include "util/common.h"
+#include "util/integral_types.h"
+#include "app/linear_method/proto/linear.pb.h"
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define LM_SGD_KERNEL_X86 1
+#endif
+namespace PS {
+namespace LM {
+
+/**
+ * @brief An array of entry values, such as the weights, indexed by uint32
+ * positions and stored in fixed-size chunks.
+ *
+ * A chunk never moves once allocated, so the array can grow by Reserve while
+ * other threads are reading and writing the reserved positions.
+ */
+template <typename V>
+class EntryArray {
+ public:
+  EntryArray() : chunks_(new std::atomic<V*>[kMaxChunks]) {
+    for (size_t i = 0; i < kMaxChunks; ++i) chunks_[i] = nullptr;
+  }
+  ~EntryArray() {
+    for (size_t i = 0; i < kMaxChunks; ++i) delete [] chunks_[i].load();
+  }
+
+  /// @brief Returns the value at position "p", which must be reserved
+  V& operator[](uint32 p) const {
+    return chunks_[p >> kChunkBits].load(std::memory_order_acquire)[
+        p & (kChunk - 1)];
+  }
+
+  /// @brief Makes the positions in [0, n) accessible, new ones are 0
+  void Reserve(size_t n) {
+    if (n <= reserved_.load(std::memory_order_acquire)) return;
+    Lock l(mu_);
+    size_t c = reserved_ >> kChunkBits;
+    for (; (c << kChunkBits) < n; ++c) {
+      CHECK_LT(c, kMaxChunks);
+      chunks_[c].store(new V[kChunk](), std::memory_order_release);
+    }
+    reserved_.store(c << kChunkBits, std::memory_order_release);
+  }
+
+ private:
+  static const int kChunkBits = 18;
+  static const size_t kChunk = (size_t)1 << kChunkBits;
+  static const size_t kMaxChunks = ((size_t)1 << 32) >> kChunkBits;
+
+  std::unique_ptr<std::atomic<V*>[]> chunks_;
+  std::atomic<size_t> reserved_{0};
+  std::mutex mu_;
+  DISALLOW_COPY_AND_ASSIGN(EntryArray);
+};
+
+/**
+ * @brief Batched FTRL and AdaGrad updates on entries stored as arrays.
+ *
+ * An update gathers the entries of a block of keys into contiguous buffers,
+ * updates them with AVX-512 or AVX2 instructions if the CPU supports them, and
+ * scatters them back. The learning rate and the elastic net penalty are
+ * inlined, and give the same results as LearningRate::eval and
+ * ElasticNet::proximal, except the rounding of the multiply-adds the compiler
+ * may fuse on AVX-512. Vectorized for float only, double uses the scalar
+ * version.
+ */
+template <typename V>
+class SGDKernel {
+ public:
+  SGDKernel() { }
+  SGDKernel(const LearningRateConfig& lr, const PenaltyConfig& h) {
+    alpha_ = lr.alpha();
+    beta_ = lr.beta();
+    decay_ = lr.type() != LearningRateConfig::CONSTANT;
+    CHECK_GT(alpha_, 0);
+    CHECK_GE(beta_, 0);
+    CHECK_GE(h.lambda_size(), 1);
+    // the same as createPenalty
+    if (h.type() == PenaltyConfig::L1) {
+      l1_ = h.lambda(0);
+      l2_ = h.lambda_size() > 1 ? h.lambda(1) : 0;
+    } else if (h.type() == PenaltyConfig::L2) {
+      l1_ = 0;
+      l2_ = h.lambda(0);
+    } else {
+      CHECK(false) << "unknown type: " << h.DebugString();
+    }
+    CHECK_GE(l1_, 0);
+    CHECK_GE(l2_, 0);
+  }
+
+  /// @brief Statistics of the weights changed by an update
+  struct Stat {
+    int64 nnz = 0;  // the change of the number of nonzero weights
+    V weight_sum = 0;
+    V delta_sum = 0;
+  };
+
+  /**
+   * @brief FTRL updates for n gradients
+   *
+   * @param pos the positions of the entries, must be unique
+   * @param grad the gradients
+   * @param w,z,sqrt_n the entry arrays, either V* or EntryArray<V>
+   */
+  template <typename A>
+  void FTRL(const uint32* pos, const V* grad, size_t n,
+            const A& w, const A& z, const A& sqrt_n, Stat* stat) const {
+    Update(true, pos, grad, n, w, z, sqrt_n, stat);
+  }
+
+  /**
+   * @brief AdaGrad updates for n gradients
+   *
+   * @param pos the positions of the entries, must be unique
+   * @param grad the gradients
+   * @param w,sum_sq_grad the entry arrays, either V* or EntryArray<V>
+   */
+  template <typename A>
+  void AdaGrad(const uint32* pos, const V* grad, size_t n,
+               const A& w, const A& sum_sq_grad, Stat* stat) const {
+    // z is not used
+    Update(false, pos, grad, n, w, sum_sq_grad, sum_sq_grad, stat);
+  }
+
+  /**
+   * @brief Uses the scalar (0), AVX2 (1) or AVX-512 (2) version, or the best
+   * one supported by the CPU if it is not. The best one is used by default
+   */
+  void set_isa(int isa) {
+#ifdef LM_SGD_KERNEL_X86
+    isa_ = std::min(isa, ISA());
+#endif
+  }
+  /// @brief Returns the version in use, see set_isa
+  int isa() const { return isa_; }
+
+ private:
+  static const size_t kBlock = 256;
+
+  template <typename A>
+  void Update(bool ftrl, const uint32* pos, const V* grad, size_t n,
+              const A& w, const A& z, const A& s, Stat* stat) const {
+    V bw[kBlock], bw_old[kBlock], bz[kBlock], bs[kBlock];
+    for (size_t b = 0; b < n; b += kBlock) {
+      size_t m = std::min(kBlock, n - b);
+      const uint32* p = pos + b;
+      for (size_t i = 0; i < m; ++i) {
+        bw[i] = bw_old[i] = w[p[i]];
+        bs[i] = s[p[i]];
+        if (ftrl) bz[i] = z[p[i]];
+      }
+      if (ftrl) {
+        FTRLBlock(m, grad + b, bw, bz, bs);
+      } else {
+        AdaGradBlock(m, grad + b, bw, bs);
+      }
+      for (size_t i = 0; i < m; ++i) {
+        w[p[i]] = bw[i];
+        s[p[i]] = bs[i];
+        if (ftrl) z[p[i]] = bz[i];
+        // the same as SGDState::UpdateWeight
+        if (bw[i] == 0 && bw_old[i] != 0) {
+          -- stat->nnz;
+        } else if (bw[i] != 0 && bw_old[i] == 0) {
+          ++ stat->nnz;
+        }
+        stat->weight_sum += bw[i] * bw[i];
+        V delta = bw[i] - bw_old[i];
+        stat->delta_sum += delta * delta;
+      }
+    }
+  }
+
+  // the scalar versions, which update entries in [begin, end)
+  V Eta(V x) const { return decay_ ? (V)alpha_ / (x + (V)beta_) : (V)alpha_; }
+  V Proximal(V x, V eta) const {
+    V leta = (V)l1_ * eta;
+    if (x <= leta && x >= -leta) return 0;
+    V d = 1 + (V)l2_ * eta;
+    return x > 0 ? (x - leta) / d : (x + leta) / d;
+  }
+  void FTRLScalar(size_t begin, size_t end, const V* g, V* w, V* z, V* s) const {
+    for (size_t i = begin; i < end; ++i) {
+      V s_new = std::sqrt(s[i] * s[i] + g[i] * g[i]);
+      V sigma = (s_new - s[i]) / (V)alpha_;
+      z[i] += g[i] - sigma * w[i];
+      s[i] = s_new;
+      V eta = Eta(s[i]);
+      w[i] = Proximal(-z[i] * eta, eta);
+    }
+  }
+  void AdaGradScalar(size_t begin, size_t end, const V* g, V* w, V* s) const {
+    for (size_t i = begin; i < end; ++i) {
+      s[i] += g[i] * g[i];
+      V eta = Eta(std::sqrt(s[i]));
+      w[i] = Proximal(w[i] - eta * g[i], eta);
+    }
+  }
+
+  void FTRLBlock(size_t n, const V* g, V* w, V* z, V* s) const {
+    FTRLScalar(0, n, g, w, z, s);
+  }
+  void AdaGradBlock(size_t n, const V* g, V* w, V* s) const {
+    AdaGradScalar(0, n, g, w, s);
+  }
+
+#ifdef LM_SGD_KERNEL_X86
+  // 0: scalar, 1: avx2, 2: avx512
+  static int ISA() {
+    static int isa = __builtin_cpu_supports("avx512f") ? 2 :
+                     (__builtin_cpu_supports("avx2") ? 1 : 0);
+    return isa;
+  }
+
+  // computes the AVX2 and AVX-512 versions of the proximal operator
+  __attribute__((target("avx2")))
+  static __m256 Proximal8(__m256 x, __m256 eta, __m256 l1, __m256 l2) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 leta = _mm256_mul_ps(l1, eta);
+    __m256 ax = _mm256_andnot_ps(sign, x);
+    __m256 d = _mm256_add_ps(_mm256_set1_ps(1), _mm256_mul_ps(l2, eta));
+    __m256 y = _mm256_div_ps(_mm256_sub_ps(ax, leta), d);
+    y = _mm256_or_ps(y, _mm256_and_ps(sign, x));
+    return _mm256_andnot_ps(_mm256_cmp_ps(ax, leta, _CMP_LE_OQ), y);
+  }
+  __attribute__((target("avx512f")))
+  static __m512 Proximal16(__m512 x, __m512 eta, __m512 l1, __m512 l2) {
+    const __m512i sign = _mm512_set1_epi32(0x80000000);
+    __m512 leta = _mm512_mul_ps(l1, eta);
+    __m512 ax = _mm512_abs_ps(x);
+    __m512 d = _mm512_add_ps(_mm512_set1_ps(1), _mm512_mul_ps(l2, eta));
+    __m512 y = _mm512_div_ps(_mm512_sub_ps(ax, leta), d);
+    y = _mm512_castsi512_ps(_mm512_or_si512(
+        _mm512_castps_si512(y),
+        _mm512_and_si512(sign, _mm512_castps_si512(x))));
+    __mmask16 zero = _mm512_cmp_ps_mask(ax, leta, _CMP_LE_OQ);
+    return _mm512_mask_mov_ps(y, zero, _mm512_setzero_ps());
+  }
+
+  __attribute__((target("avx2")))
+  static __m256 Eta8(__m256 x, bool decay, __m256 alpha, __m256 beta) {
+    return decay ? _mm256_div_ps(alpha, _mm256_add_ps(x, beta)) : alpha;
+  }
+  __attribute__((target("avx512f")))
+  static __m512 Eta16(__m512 x, bool decay, __m512 alpha, __m512 beta) {
+    return decay ? _mm512_div_ps(alpha, _mm512_add_ps(x, beta)) : alpha;
+  }
+
+  __attribute__((target("avx2")))
+  void FTRLAVX2(size_t n, const float* g, float* w, float* z, float* s) const {
+    __m256 alpha = _mm256_set1_ps(alpha_), beta = _mm256_set1_ps(beta_);
+    __m256 l1 = _mm256_set1_ps(l1_), l2 = _mm256_set1_ps(l2_);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m256 gi = _mm256_loadu_ps(g + i), wi = _mm256_loadu_ps(w + i);
+      __m256 zi = _mm256_loadu_ps(z + i), si = _mm256_loadu_ps(s + i);
+      __m256 s_new = _mm256_sqrt_ps(_mm256_add_ps(
+          _mm256_mul_ps(si, si), _mm256_mul_ps(gi, gi)));
+      __m256 sigma = _mm256_div_ps(_mm256_sub_ps(s_new, si), alpha);
+      zi = _mm256_add_ps(zi, _mm256_sub_ps(gi, _mm256_mul_ps(sigma, wi)));
+      __m256 eta = Eta8(s_new, decay_, alpha, beta);
+      wi = Proximal8(_mm256_mul_ps(_mm256_xor_ps(zi, sign), eta), eta, l1, l2);
+      _mm256_storeu_ps(w + i, wi);
+      _mm256_storeu_ps(z + i, zi);
+      _mm256_storeu_ps(s + i, s_new);
+    }
+    FTRLScalar(i, n, g, w, z, s);
+  }
+  __attribute__((target("avx512f")))
+  void FTRLAVX512(size_t n, const float* g, float* w, float* z, float* s) const {
+    __m512 alpha = _mm512_set1_ps(alpha_), beta = _mm512_set1_ps(beta_);
+    __m512 l1 = _mm512_set1_ps(l1_), l2 = _mm512_set1_ps(l2_);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+      __m512 gi = _mm512_loadu_ps(g + i), wi = _mm512_loadu_ps(w + i);
+      __m512 zi = _mm512_loadu_ps(z + i), si = _mm512_loadu_ps(s + i);
+      __m512 s_new = _mm512_sqrt_ps(_mm512_add_ps(
+          _mm512_mul_ps(si, si), _mm512_mul_ps(gi, gi)));
+      __m512 sigma = _mm512_div_ps(_mm512_sub_ps(s_new, si), alpha);
+      zi = _mm512_add_ps(zi, _mm512_sub_ps(gi, _mm512_mul_ps(sigma, wi)));
+      __m512 eta = Eta16(s_new, decay_, alpha, beta);
+      __m512 x = _mm512_mul_ps(_mm512_sub_ps(_mm512_setzero_ps(), zi), eta);
+      wi = Proximal16(x, eta, l1, l2);
+      _mm512_storeu_ps(w + i, wi);
+      _mm512_storeu_ps(z + i, zi);
+      _mm512_storeu_ps(s + i, s_new);
+    }
+    FTRLScalar(i, n, g, w, z, s);
+  }
+
+  __attribute__((target("avx2")))
+  void AdaGradAVX2(size_t n, const float* g, float* w, float* s) const {
+    __m256 alpha = _mm256_set1_ps(alpha_), beta = _mm256_set1_ps(beta_);
+    __m256 l1 = _mm256_set1_ps(l1_), l2 = _mm256_set1_ps(l2_);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m256 gi = _mm256_loadu_ps(g + i), wi = _mm256_loadu_ps(w + i);
+      __m256 si = _mm256_add_ps(_mm256_loadu_ps(s + i), _mm256_mul_ps(gi, gi));
+      __m256 eta = Eta8(_mm256_sqrt_ps(si), decay_, alpha, beta);
+      wi = Proximal8(_mm256_sub_ps(wi, _mm256_mul_ps(eta, gi)), eta, l1, l2);
+      _mm256_storeu_ps(w + i, wi);
+      _mm256_storeu_ps(s + i, si);
+    }
+    AdaGradScalar(i, n, g, w, s);
+  }
+  __attribute__((target("avx512f")))
+  void AdaGradAVX512(size_t n, const float* g, float* w, float* s) const {
+    __m512 alpha = _mm512_set1_ps(alpha_), beta = _mm512_set1_ps(beta_);
+    __m512 l1 = _mm512_set1_ps(l1_), l2 = _mm512_set1_ps(l2_);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+      __m512 gi = _mm512_loadu_ps(g + i), wi = _mm512_loadu_ps(w + i);
+      __m512 si = _mm512_add_ps(_mm512_loadu_ps(s + i), _mm512_mul_ps(gi, gi));
+      __m512 eta = Eta16(_mm512_sqrt_ps(si), decay_, alpha, beta);
+      wi = Proximal16(_mm512_sub_ps(wi, _mm512_mul_ps(eta, gi)), eta, l1, l2);
+      _mm512_storeu_ps(w + i, wi);
+      _mm512_storeu_ps(s + i, si);
+    }
+    AdaGradScalar(i, n, g, w, s);
+  }
+#endif  // LM_SGD_KERNEL_X86
+
+  double alpha_ = 1, beta_ = 0, l1_ = 0, l2_ = 0;
+  bool decay_ = false;
+#ifdef LM_SGD_KERNEL_X86
+  int isa_ = ISA();
+#else
+  int isa_ = 0;
+#endif
+};
+
+#ifdef LM_SGD_KERNEL_X86
+template <>
+inline void SGDKernel<float>::FTRLBlock(
+    size_t n, const float* g, float* w, float* z, float* s) const {
+  switch (isa_) {
+    case 2: FTRLAVX512(n, g, w, z, s); break;
+    case 1: FTRLAVX2(n, g, w, z, s); break;
+    default: FTRLScalar(0, n, g, w, z, s);
+  }
+}
+
+template <>
+inline void SGDKernel<float>::AdaGradBlock(
+    size_t n, const float* g, float* w, float* s) const {
+  switch (isa_) {
+    case 2: AdaGradAVX512(n, g, w, s); break;
+    case 1: AdaGradAVX2(n, g, w, s); break;
+    default: AdaGradScalar(0, n, g, w, s);
+  }
+}
+#endif  // LM_SGD_KERNEL_X86
+
+} // namespace LM
+} // namespace PS
@@ -190,6 +190,7 @@ class BCDServer : public BCDCompNode<V> {
       auto& grp = model_[fea_grp_[i]];
       grp.value.resize(grp.key.size());
       grp.value.SetValue(bcd_conf_.init_w());
+      WarmStart(fea_grp_[i], grp.key, &grp.value);
       model_.FinishReceivedRequest(time+1, kWorkerGroup);
     }
     model_.ClearFilter();
@@ -214,8 +215,47 @@ class BCDServer : public BCDCompNode<V> {
         }
       }
       LI << MyNodeID() << " written the model to " << file;
+    } else if (output.format() == DataConfig::BIN) {
+      CHECK(output.file_size());
+      std::string file = output.file(0) + "_" + MyNodeID();
+      model_.SaveCheckpoint(file);
+      LI << MyNodeID() << " written the checkpoint to " << file;
     }
   }
+
+  /**
+   * @brief Warm starts from the checkpoint in "input", which is saved by the
+   * server with the same node id. It should be called before PreprocessData,
+   * which then overwrites the initial weights of the keys in the checkpoint
+   */
+  void LoadModel(const DataConfig& input) {
+    if (input.format() != DataConfig::BIN || !input.file_size()) return;
+    std::string file = input.file(0) + "_" + MyNodeID();
+    warm_start_ = std::unique_ptr<CheckpointReader<Key, V>>(
+        new CheckpointReader<Key, V>());
+    CHECK(warm_start_->Open(file));
+    LI << MyNodeID() << " loaded the checkpoint " << file;
+  }
+
+ private:
+  // copies the weights of feature group "grp" in the checkpoint into "value"
+  void WarmStart(int grp, const SArray<Key>& key, SArray<V>* value) {
+    if (!warm_start_) return;
+    for (int i = 0; i < warm_start_->num_segments(); ++i) {
+      const auto& seg = warm_start_->segment(i);
+      if (seg.channel != grp) continue;
+      CHECK(seg.key) << "feature group " << grp << " is dense";
+      CHECK_EQ(seg.k, 1);
+      // zero-copy wrappers of the mapped data
+      SArray<Key> ckpt_key((Key*)seg.key, seg.n, false);
+      SArray<V> ckpt_value((V*)seg.value, seg.n, false);
+      size_t n = ParallelOrderedMatch(ckpt_key, ckpt_value, key, value);
+      VLOG(1) << "warm started " << n << " of " << key.size()
+              << " weights in feature group " << grp;
+    }
+  }
+  std::unique_ptr<CheckpointReader<Key, V>> warm_start_;
+ protected:
   USING_BCD_COMP_NODE;
 };
 
@@ -0,0 +1,353 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util/common.h"
+#include "util/shared_array.h"
+#include "util/parallel_pool.h"
+#include "util/parallel_sort.h"
+#include "util/file.h"
+namespace PS {
+
+/**
+ * @brief The binary checkpoint format of parameters.
+ *
+ * A checkpoint is a list of segments, such as the channels of a KVVector or the
+ * layers of a KVLayer. A segment has n sorted keys, and k values per key. The
+ * file layout is
+   \verbatim
+   header   | magic, version, sizeof(K), sizeof(V), number of segments
+   segments | per segment: channel, n, k, and the offsets of its blocks
+   keys     | per segment: key_0, ..., key_{n-1}. omitted if dense
+   values   | per segment: val_00, ..., val_0k, ..., val_{n-1}0, ..., val_{n-1}k
+   index    | per segment: key_0, key_B, key_2B, ..., with B = kIndexBlock
+   \endverbatim
+ * and every block starts at a multiple of kAlign bytes. A dense segment, such as
+ * a layer, has keys 0, ..., n-1, which are not stored.
+ *
+ * CheckpointWriter writes a file by multiple threads, each of them writes a
+ * part of the blocks by pwrite. CheckpointReader maps a file into memory and
+ * uses the blocks in place, so loading costs no parsing. Numbers are in the
+ * host byte order, and the file should be on a local file system.
+ */
+struct Checkpoint {
+  static const uint32 kMagic = 0x4b435350;  // "PSCK"
+  static const uint32 kVersion = 1;
+  static const size_t kAlign = 64;
+  static const size_t kIndexBlock = 1024;
+
+  struct Header {
+    uint32 magic;
+    uint32 version;
+    uint32 key_size;
+    uint32 value_size;
+    uint64 num_segments;
+  };
+
+  struct Segment {
+    int32 channel;
+    uint32 k;
+    uint64 n;
+    uint64 dense;
+    // the offsets of the blocks in the file
+    uint64 key_offset;
+    uint64 value_offset;
+    uint64 index_offset;
+  };
+
+  static size_t Align(size_t offset) {
+    return (offset + kAlign - 1) / kAlign * kAlign;
+  }
+};
+
+/**
+ * @brief Sorts the key-value pairs by key, where key[i] has the values
+ * value[i*k], ..., value[i*k+k-1]
+ */
+template <typename K, typename V>
+void SortKeyValue(SArray<K>* key, SArray<V>* value, int k,
+                  int num_threads = FLAGS_num_threads) {
+  size_t n = key->size();
+  CHECK_EQ(n * k, value->size());
+  SArray<size_t> idx(n);
+  for (size_t i = 0; i < n; ++i) idx[i] = i;
+  const K* k0 = key->data();
+  ParallelSort(&idx, std::max(num_threads, 1), [k0](size_t a, size_t b) {
+      return k0[a] < k0[b];
+    });
+  SArray<K> new_key(n);
+  SArray<V> new_value(n * k);
+  for (size_t i = 0; i < n; ++i) {
+    new_key[i] = k0[idx[i]];
+    memcpy(new_value.data() + i * k, value->data() + idx[i] * k,
+           k * sizeof(V));
+  }
+  *key = new_key;
+  *value = new_value;
+}
+
+/**
+ * @brief Writes a checkpoint
+ *
+ * Sample usage:
+ *   CheckpointWriter<Key, float> writer;
+ *   writer.Add(0, key, value, 1);
+ *   CHECK(writer.Write("model_S0"));
+ */
+template <typename K, typename V>
+class CheckpointWriter {
+ public:
+  /**
+   * @brief Adds a segment
+   *
+   * @param channel the channel, or any id, of the segment
+   * @param key sorted and unique keys, or empty for the dense keys
+   * 0, ..., value.size() / k - 1
+   * @param value k values per key
+   * @param k
+   */
+  void Add(int channel, const SArray<K>& key, const SArray<V>& value, int k) {
+    CHECK_GT(k, 0);
+    Data d;
+    d.channel = channel; d.k = k; d.key = key; d.value = value;
+    d.dense = key.empty();
+    d.n = d.dense ? value.size() / k : key.size();
+    CHECK_EQ(d.n * k, value.size());
+    if (!d.dense) {
+      for (size_t i = 0; i < d.n; i += Checkpoint::kIndexBlock) {
+        d.index.push_back(key[i]);
+      }
+    }
+    segs_.push_back(d);
+  }
+
+  /**
+   * @brief Writes the segments into "file" by "num_threads" threads. The data
+   * are written into "file.tmp" first, which is then renamed to "file"
+   */
+  bool Write(const std::string& file, int num_threads = FLAGS_num_threads) {
+    if (!dirExists(getPath(file))) createDir(getPath(file));
+
+    // the layout
+    Checkpoint::Header header;
+    header.magic = Checkpoint::kMagic;
+    header.version = Checkpoint::kVersion;
+    header.key_size = sizeof(K);
+    header.value_size = sizeof(V);
+    header.num_segments = segs_.size();
+    std::vector<Checkpoint::Segment> info(segs_.size());
+    size_t offset = sizeof(header) + info.size() * sizeof(Checkpoint::Segment);
+    std::vector<Block> blocks;
+    for (size_t i = 0; i < segs_.size(); ++i) {
+      const auto& d = segs_[i];
+      auto& s = info[i];
+      memset(&s, 0, sizeof(s));
+      s.channel = d.channel; s.k = d.k; s.n = d.n; s.dense = d.dense;
+      if (!d.dense) {
+        s.key_offset = offset = Checkpoint::Align(offset);
+        AddBlock(d.key.data(), d.n * sizeof(K), &offset, &blocks);
+      }
+      s.value_offset = offset = Checkpoint::Align(offset);
+      AddBlock(d.value.data(), d.value.size() * sizeof(V), &offset, &blocks);
+      s.index_offset = offset = Checkpoint::Align(offset);
+      AddBlock(d.index.data(), d.index.size() * sizeof(K), &offset, &blocks);
+    }
+    size_t head = 0;
+    AddBlock(&header, sizeof(header), &head, &blocks);
+    AddBlock(info.data(), info.size() * sizeof(Checkpoint::Segment), &head,
+             &blocks);
+
+    std::string tmp = file + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      LOG(ERROR) << "failed to open " << tmp << ": " << strerror(errno);
+      return false;
+    }
+    bool ok = ftruncate(fd, offset) == 0;
+
+    // threads write the blocks in a round robin way
+    int np = (int)std::min(blocks.size(), (size_t)std::max(num_threads, 1));
+    std::atomic<bool> good(ok);
+    if (ok) {
+      ParallelPool::instance().Run(np, [&blocks, &good, fd, np](int p) {
+          for (size_t i = p; i < blocks.size() && good; i += np) {
+            if (!PWrite(fd, blocks[i])) good = false;
+          }
+        });
+    }
+    // flush it before renaming, so a crash never leaves a partial file with
+    // the final name
+    ok = good && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (ok) ok = rename(tmp.c_str(), file.c_str()) == 0;
+    if (!ok) {
+      LOG(ERROR) << "failed to write " << file << ": " << strerror(errno);
+      unlink(tmp.c_str());
+      return false;
+    }
+    VLOG(1) << "written " << segs_.size() << " segments, " << offset
+            << " bytes into " << file;
+    return true;
+  }
+
+ private:
+  struct Data {
+    int channel;
+    int k;
+    size_t n;
+    bool dense;
+    SArray<K> key;
+    SArray<V> value;
+    std::vector<K> index;
+  };
+  std::vector<Data> segs_;
+
+  // a piece of data written at "offset" of the file
+  struct Block {
+    const char* data;
+    size_t size;
+    size_t offset;
+  };
+
+  // appends the data at "*offset", which are cut into blocks so that threads
+  // can write a large segment together
+  static void AddBlock(const void* data, size_t size, size_t* offset,
+                       std::vector<Block>* blocks) {
+    const size_t kBlock = 1 << 24;
+    const char* p = (const char*) data;
+    for (size_t i = 0; i < size; i += kBlock) {
+      Block b;
+      b.data = p + i; b.size = std::min(kBlock, size - i); b.offset = *offset + i;
+      blocks->push_back(b);
+    }
+    *offset += size;
+  }
+
+  static bool PWrite(int fd, const Block& b) {
+    size_t done = 0;
+    while (done < b.size) {
+      ssize_t n = pwrite(fd, b.data + done, b.size - done, b.offset + done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      done += n;
+    }
+    return true;
+  }
+};
+
+/**
+ * @brief Reads a checkpoint by mapping it into memory.
+ *
+ * The keys and values point into the mapped file, so they are valid until the
+ * reader is closed or destroyed.
+ */
+template <typename K, typename V>
+class CheckpointReader {
+ public:
+  CheckpointReader() { }
+  ~CheckpointReader() { Close(); }
+
+  /// @brief A segment in the mapped file
+  struct Segment {
+    int channel;
+    int k;
+    size_t n;
+    const K* key;    // n keys, or nullptr if dense
+    const V* value;  // n * k values
+    const K* index;  // the first key of every kIndexBlock keys
+    size_t index_n;
+
+    /// @brief Returns the i-th key
+    K key_at(size_t i) const { return key ? key[i] : (K)i; }
+
+    /// @brief Returns the position of "k", or -1 if not found
+    size_t Find(K k) const {
+      if (!key) return (k >= 0 && (size_t)k < n) ? (size_t)k : (size_t)-1;
+      // find the block by the index, then the key in the block
+      size_t b = std::upper_bound(index, index + index_n, k) - index;
+      if (b == 0) return (size_t)-1;
+      size_t lo = (b - 1) * Checkpoint::kIndexBlock;
+      size_t hi = std::min(lo + Checkpoint::kIndexBlock, n);
+      size_t i = std::lower_bound(key + lo, key + hi, k) - key;
+      return (i < hi && key[i] == k) ? i : (size_t)-1;
+    }
+  };
+
+  /// @brief Maps "file" into memory, returns false if it is not a valid
+  /// checkpoint
+  bool Open(const std::string& file) {
+    Close();
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+      LOG(ERROR) << "failed to open " << file << ": " << strerror(errno);
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Checkpoint::Header)) {
+      LOG(ERROR) << file << " is not a checkpoint";
+      close(fd);
+      return false;
+    }
+    size_ = st.st_size;
+    void* addr = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      LOG(ERROR) << "failed to map " << file << ": " << strerror(errno);
+      return false;
+    }
+    addr_ = (const char*) addr;
+    if (!Parse()) {
+      LOG(ERROR) << file << " is not a valid checkpoint";
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  void Close() {
+    if (addr_) munmap((void*)addr_, size_);
+    addr_ = nullptr; size_ = 0;
+    segs_.clear();
+  }
+
+  int num_segments() const { return (int)segs_.size(); }
+  const Segment& segment(int i) const { return segs_[i]; }
+
+ private:
+  bool Parse() {
+    const auto* h = (const Checkpoint::Header*) addr_;
+    if (h->magic != Checkpoint::kMagic || h->version != Checkpoint::kVersion ||
+        h->key_size != sizeof(K) || h->value_size != sizeof(V)) {
+      return false;
+    }
+    size_t head = sizeof(*h) + h->num_segments * sizeof(Checkpoint::Segment);
+    if (head > size_) return false;
+    const auto* info = (const Checkpoint::Segment*)(addr_ + sizeof(*h));
+    for (size_t i = 0; i < h->num_segments; ++i) {
+      const auto& s = info[i];
+      Segment seg;
+      seg.channel = s.channel; seg.k = s.k; seg.n = s.n;
+      seg.index_n = s.dense ? 0 : (s.n + Checkpoint::kIndexBlock - 1) /
+                    Checkpoint::kIndexBlock;
+      if (s.k == 0 ||
+          (!s.dense && s.key_offset + s.n * sizeof(K) > size_) ||
+          s.value_offset + s.n * s.k * sizeof(V) > size_ ||
+          s.index_offset + seg.index_n * sizeof(K) > size_) {
+        return false;
+      }
+      seg.key = s.dense ? nullptr : (const K*)(addr_ + s.key_offset);
+      seg.value = (const V*)(addr_ + s.value_offset);
+      seg.index = (const K*)(addr_ + s.index_offset);
+      segs_.push_back(seg);
+    }
+    return true;
+  }
+
+  const char* addr_ = nullptr;
+  size_t size_ = 0;
+  std::vector<Segment> segs_;
+  DISALLOW_COPY_AND_ASSIGN(CheckpointReader);
+};
+
+}  // namespace PS
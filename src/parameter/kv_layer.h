@@ -1,6 +1,7 @@
 #pragma once
 #include "ps.h"
 #include "parameter/parameter.h"
+#include "parameter/checkpoint.h"
 namespace PS {
 
 /**
@@ -12,13 +13,73 @@ class KVLayerUpdater {
   /// @brief initialize the data
   void Init(int id, size_t size, V* data) { }
 
-  /// @brief update the model by using received data
+  /// @brief update the model by using received data. if the data are sent in
+  /// chunks (-chunk_size), it is called per chunk with "data" pointing to the
+  /// segment of the layer
   void Update(int id, size_t size, const V* recv_data, V* data) { }
 };
 
+/**
+ * @brief Plans the placement of layers on "n" servers by their sizes, see
+ * KVLayer::SetLayerSizes. The result only depends on the arguments.
+ *
+ * @param sizes <key, size> pairs
+ * @param partition_thr a layer is divided into parts with at least this many
+ * entries
+ * @param n the number of servers
+ * @return <key, the key range of the layer on each server>, which is empty if
+ * the server has no part of the layer
+ */
+inline std::unordered_map<int, std::vector<Range<Key>>> PlanLayerLayout(
+    const std::vector<std::pair<int, size_t>>& sizes, size_t partition_thr,
+    int n) {
+  CHECK_GT(n, 0);
+  std::unordered_map<int, std::vector<Range<Key>>> layouts;
+  std::vector<size_t> load(n, 0);
+  // from the largest one, and break ties by key so all workers agree
+  auto layers = sizes;
+  std::sort(layers.begin(), layers.end(),
+            [](const std::pair<int, size_t>& a, const std::pair<int, size_t>& b) {
+              return a.second != b.second ? a.second > b.second : a.first < b.first;
+            });
+  std::vector<int> server(n);
+  for (const auto& l : layers) {
+    size_t m = std::max(l.second / std::max(partition_thr, (size_t)1), (size_t)1);
+    m = std::min(m, (size_t)n);
+    // the m least loaded servers, sorted by their ids
+    for (int i = 0; i < n; ++i) server[i] = i;
+    std::stable_sort(server.begin(), server.end(), [&load](int a, int b) {
+        return load[a] < load[b];
+      });
+    std::sort(server.begin(), server.begin() + m);
+
+    auto& layout = layouts[l.first];
+    layout.assign(n, Range<Key>(0,0));
+    Range<Key> kr(0, l.second);
+    for (size_t j = 0; j < m; ++j) {
+      layout[server[j]] = kr.EvenDivide(m, j);
+      load[server[j]] += layout[server[j]].size();
+    }
+  }
+  VLOG(1) << "placed " << layers.size() << " layers into " << n
+          << " servers, the most loaded one has "
+          << *std::max_element(load.begin(), load.end())
+          << " entries, the least loaded one has "
+          << *std::min_element(load.begin(), load.end());
+  return layouts;
+}
+
 /**
  * @brief multiple layers with various size
  *
+ * On servers, a pull is answered with the current version of the layer without
+ * copying. An update is written into the layer in place if no pull holds the
+ * current version any more, otherwise it is written into a copy, which is then
+ * published as the new version. A push sent in chunks (-chunk_size) is always
+ * written into a copy, made by its first chunk and published after its last
+ * one, or after the last one of the chunked pushes overlapping with it. So a
+ * pull never sees a partial update.
+ *
  * @tparam V value type
  * @tparam Updater the updater class.
  */
@@ -27,6 +88,8 @@ class  KVLayer : public Parameter {
  public:
   /**
    * @brief constructor
+   * @param partition_thr a layer with less entries is sent to a single server,
+   * and a larger one is divided into parts with at least this many entries
    * @param id customer id
    */
   KVLayer(size_t partition_thr = 1000, int id = NextCustomerID()) :
@@ -37,10 +100,39 @@ class  KVLayer : public Parameter {
   void set_updater(Updater* updt) { updater_ = updt; }
 
   /// @brief get the layer by the key
-  SArray<V> operator[] (int key) { Lock l(mu_); return layer_[key]; }
+  SArray<V> operator[] (int key) { return layer(key); }
 
   /// @brief get the layer by the key
-  SArray<V> layer(int key) { Lock l(mu_); return layer_[key]; }
+  SArray<V> layer(int key) {
+    auto& l = GetLayer(key); Lock lk(l.mu); return l.data;
+  }
+
+  /**
+   * @brief Sets the sizes of the layers, so they are placed on servers by
+   * bytes.
+   *
+   * A layer is divided into size / partition_thr parts, at most one per server.
+   * From the largest layer on, the parts of a layer are assigned to the least
+   * loaded servers. The layout is planned once the number of servers is known,
+   * and then reused by all pushes and pulls. All workers should set the same
+   * sizes so that they get the same layout. A layer not set here is placed by
+   * the default rule: sent to a single server if it is smaller than
+   * partition_thr, otherwise divided evenly into all servers.
+   *
+   * It should be called before the first push or pull. Servers keep the part
+   * of a layer they got first, so a layout changed later would not match it.
+   * A server checks the key range of every request against its part.
+   *
+   * @param sizes <key, size> pairs
+   */
+  void SetLayerSizes(const std::vector<std::pair<int, size_t>>& sizes) {
+    Lock l(mu_);
+    CHECK(!sliced_) << "SetLayerSizes is called after pushes or pulls";
+    layer_size_ = sizes;
+    std::sort(layer_size_.begin(), layer_size_.end());
+    layout_.clear();
+    layout_servers_ = 0;
+  }
 
   // void set_layer(int key, V* data, size_t size) {
   //   layer_[key] = SArray<V>(data, size, false);
@@ -55,10 +147,12 @@ class  KVLayer : public Parameter {
    * @param zero_copy if true, the system will not copy "data", which means
    * the content of "data" should not be modified or delete utill the push has
    * been successed. namely Wait() returns.
+   * @param callback the callback function will be called once push is finished.
    *
    * @return the timestamp of the push request
    */
-  int Push(const Task& task, V* data, size_t size, bool zero_copy = false);
+  int Push(const Task& task, V* data, size_t size, bool zero_copy = false,
+           Message::Callback callback = Message::Callback());
 
   /**
    * @brief Sent a pull request to servers.
@@ -74,21 +168,84 @@ class  KVLayer : public Parameter {
   int Pull(const Task& task, V* data, size_t size,
            Message::Callback callback = Message::Callback());
 
+  /**
+   * @brief The same as Push, but returns a future finished once the push is
+   * finished
+   */
+  Future PushAsync(const Task& task, V* data, size_t size,
+                   bool zero_copy = false) {
+    Promise done;
+    int ts = Push(task, data, size, zero_copy, [done]() { done.Finish(); });
+    return done.future(ts);
+  }
+
+  /**
+   * @brief The same as Pull, but returns a future finished once the pulled
+   * data is written
+   */
+  Future PullAsync(const Task& task, V* data, size_t size) {
+    Promise done;
+    int ts = Pull(task, data, size, [done]() { done.Finish(); });
+    return done.future(ts);
+  }
+
   virtual void Slice(const Message& request, const std::vector<Range<Key>>& krs,
                      std::vector<Message*>* msgs);
+  virtual void Chunk(const Message& msg, size_t max_bytes,
+                     std::vector<Message*>* chunks) {
+    ChunkDenseMessage(msg, max_bytes, chunks);
+  }
   virtual void GetValue(Message* msg);
   virtual void SetValue(const Message* msg);
+
+  /// @brief Writes the layers, each of them is a dense segment
+  virtual void SaveCheckpoint(std::string file);
+  /// @brief Replaces the layers in the checkpoint by its data
+  virtual void LoadCheckpoint(std::string file);
  protected:
-  std::mutex mu_;
-  std::unordered_map<int, SArray<V>> layer_;
+  struct Layer {
+    SArray<V> data;       // the current version
+    std::mutex mu;        // protects data
+    std::mutex write_mu;  // serializes the updates, protects next and writing
+    // on servers, the key range of the part kept here. protected by mu
+    Range<Key> kr;
+    // the next version, not published until the chunked pushes in "writing",
+    // namely <sender, timestamp>, are fully applied
+    SArray<V> next;
+    std::set<std::pair<NodeID, int>> writing;
+  };
+  // returns the layer of "key", inserts one if not found
+  Layer& GetLayer(int key) { Lock l(mu_); return layer_[key]; }
+
+  std::mutex mu_;  // protects the structure of layer_
+  std::unordered_map<int, Layer> layer_;
   size_t partition_thr_;
   Updater* updater_ = nullptr;
 
+  // <key, size>, sorted by key
+  std::vector<std::pair<int, size_t>> layer_size_;
+  // <key, the key range of the layer on each server>, planned for
+  // layout_servers_ servers
+  std::unordered_map<int, std::vector<Range<Key>>> layout_;
+  int layout_servers_ = 0;
+  // true once a push or pull is sliced by the layout
+  bool sliced_ = false;
+
+  // on servers, checks that "kr" is the part of "layer" kept here. must hold
+  // layer->mu
+  void CheckPart(Layer* layer, const Range<Key>& kr) {
+    if (!IsServer()) return;
+    if (layer->kr.empty()) layer->kr = kr;
+    CHECK_EQ(layer->kr, kr) << "the layout of a layer is changed after it is "
+                            << "pushed or pulled, see SetLayerSizes";
+  }
+
   int call_ = 0;
 };
 
 template <typename V, class Updater>
-int KVLayer<V, Updater>::Push(const Task& task, V* data, size_t size, bool zero_copy) {
+int KVLayer<V, Updater>::Push(const Task& task, V* data, size_t size,
+                              bool zero_copy, Message::Callback callback) {
   // LOG_FIRST_N(INFO, 100) << size;
   SArray<V> val;
   if (zero_copy) {
@@ -99,17 +256,21 @@ int KVLayer<V, Updater>::Push(const Task& task, V* data, size_t size, bool zero_
   Message push(task, kServerGroup);
   Range<Key>(0, size).To(push.task.mutable_key_range());
   push.add_value(val);
+  if (callback) push.callback = callback;
   return Parameter::Push(&push);
 }
 
 template <typename V, class Updater>
 int KVLayer<V, Updater>::Pull(
     const Task& task, V* data, size_t size, std::function<void()> callback) {
-  int id = task.key_channel();
-  if (data == NULL) {
-    if (layer_[id].size() != size) layer_[id].resize(size, 0);
-  } else {
-    layer_[id] = SArray<V>(data, size, false);
+  auto& layer = GetLayer(task.key_channel());
+  {
+    Lock l(layer.mu);
+    if (data == NULL) {
+      if (layer.data.size() != size) layer.data.resize(size, 0);
+    } else {
+      layer.data = SArray<V>(data, size, false);
+    }
   }
   Message pull(task, kServerGroup);
   Range<Key>(0, size).To(pull.task.mutable_key_range());
@@ -125,10 +286,37 @@ void KVLayer<V, Updater>::Slice(
   size_t n = krs.size();
   int key = request.task.key_channel();
   Range<Key> kr(request.task.key_range());
+  std::vector<Range<Key>> layout;
+  {
+    Lock l(mu_);
+    sliced_ = true;
+    if (!layer_size_.empty()) {
+      if (layout_servers_ != (int)n) {
+        layout_ = PlanLayerLayout(layer_size_, partition_thr_, n);
+        layout_servers_ = n;
+      }
+      auto it = layout_.find(key);
+      if (it != layout_.end()) layout = it->second;
+    }
+  }
   for (size_t i = 0; i < n; ++i) {
     Message* msg = (*msgs)[i];
     auto mut_kr = msg->task.mutable_key_range();
-    if (kr.size() < partition_thr_) {
+    if (!layout.empty()) {
+      // the planned layout
+      if (i == 0) {
+        Key end = 0;
+        for (const auto& r : layout) end = std::max(end, r.end());
+        CHECK_EQ(kr, Range<Key>(0, end))
+            << "layer " << key << " differs from the size set by SetLayerSizes";
+      }
+      if (layout[i].empty()) {
+        Range<Key>(0,0).To(mut_kr);
+        msg->valid = false;
+      } else {
+        layout[i].To(mut_kr);
+      }
+    } else if (kr.size() < partition_thr_) {
       // a tiny layer, sent it to server k
       int k = (key * 991) % n;
       if ((int)i == k) {
@@ -158,54 +346,119 @@ void KVLayer<V, Updater>::Slice(
 }
 
 template <typename V, class Updater>
-void KVLayer<V, Updater>::GetValue(Message* msg) {
+void KVLayer<V, Updater>::SaveCheckpoint(std::string file) {
+  std::vector<int> keys;
+  {
+    Lock l(mu_);
+    for (const auto& it : layer_) keys.push_back(it.first);
+  }
+  std::sort(keys.begin(), keys.end());
+  CheckpointWriter<Key, V> writer;
+  for (int key : keys) {
+    // on servers, holding the version makes updates write into a copy
+    auto data = layer(key);
+    if (!data.empty()) writer.Add(key, SArray<Key>(), data, 1);
+  }
+  CHECK(writer.Write(file));
+}
+
+template <typename V, class Updater>
+void KVLayer<V, Updater>::LoadCheckpoint(std::string file) {
+  CheckpointReader<Key, V> reader;
+  CHECK(reader.Open(file));
+  for (int i = 0; i < reader.num_segments(); ++i) {
+    const auto& seg = reader.segment(i);
+    CHECK_EQ(seg.k, 1);
+    CHECK(!seg.key) << "a sparse checkpoint";
+    SArray<V> data;
+    data.CopyFrom(seg.value, seg.n);
+    auto& layer = GetLayer(seg.channel);
+    Lock l(layer.mu);
+    layer.data = data;
+  }
+}
 
-  // Lock l(mu_);
-  mu_.lock();
-  auto& my_val = layer_[msg->task.key_channel()];
-  mu_.unlock();
+template <typename V, class Updater>
+void KVLayer<V, Updater>::GetValue(Message* msg) {
+  int key = msg->task.key_channel();
+  auto& layer = GetLayer(key);
   Range<Key> kr(msg->task.key_range());
-  if (my_val.empty()) {
-    // initialize weight
-    my_val.resize(kr.size(), 0);
-    CHECK_NOTNULL(updater_)->Init(
-        msg->task.key_channel(), my_val.size(), my_val.data());
+  SArray<V> my_val;
+  {
+    Lock l(layer.mu);
+    CheckPart(&layer, kr);
+    if (layer.data.empty()) {
+      // initialize weight
+      layer.data.resize(kr.size(), 0);
+      CHECK_NOTNULL(updater_)->Init(key, kr.size(), layer.data.data());
+    }
+    my_val = layer.data;
   }
 
+  // no copy. the message holds this version, so it will not be updated in
+  // place until the message is sent
   CHECK_EQ(my_val.size(), kr.size());
-  SArray<V> send_data(kr.size());
-  send_data.CopyFrom(my_val);  // TODO, memcpy?
-  msg->add_value(send_data);
+  msg->add_value(my_val);
 }
 
 template <typename V, class Updater>
 void KVLayer<V, Updater>::SetValue(const Message* msg) {
-  // Lock l(mu_);
   CHECK_EQ(msg->value.size(), 1);
   SArray<V> recv_data(msg->value[0]);
   Range<Key> kr(msg->task.key_range());
-  CHECK_EQ(kr.size(), recv_data.size());
+  // the key range of the received data, a part of kr if it is a chunk
+  Range<Key> data_kr = msg->task.chunk().has_key_range() ?
+                       Range<Key>(msg->task.chunk().key_range()) : kr;
+  CHECK_EQ(data_kr.size(), recv_data.size());
   int key = msg->task.key_channel();
-  mu_.lock();
-  auto& my_val = layer_[key];
-  mu_.unlock();
+  auto& layer = GetLayer(key);
 
   if (IsWorker()) {
+    Lock l(layer.mu);
+    auto& my_val = layer.data;
     if (my_val.empty()) my_val.resize(kr.size(), 0);
-    CHECK_GE(my_val.size(), kr.end());
-    my_val.Segment(kr).CopyFrom(recv_data);
+    CHECK_GE(my_val.size(), data_kr.end());
+    my_val.Segment(data_kr).CopyFrom(recv_data);
   } else if (IsServer()) {
     // TODO this server can do flexible consistency control here
-
-    if (my_val.empty()) {
+    Lock w(layer.write_mu);
+    std::unique_lock<std::mutex> l(layer.mu);
+    CheckPart(&layer, kr);
+    if (layer.data.empty()) {
       // initialize weight
-      my_val.resize(kr.size(), 0);
-      CHECK_NOTNULL(updater_)->Init(key, kr.size(), my_val.data());
+      layer.data.resize(kr.size(), 0);
+      CHECK_NOTNULL(updater_)->Init(key, kr.size(), layer.data.data());
     }
 
     // update weight
-    CHECK_GE(my_val.size(), kr.size());
-    CHECK_NOTNULL(updater_)->Update(key, kr.size(), recv_data.data(), my_val.data());
+    CHECK_GE(layer.data.size(), kr.size());
+    size_t offset = data_kr.begin() - kr.begin();
+    bool chunked = msg->task.has_chunk();
+    if (chunked) layer.writing.insert(std::make_pair(msg->sender, msg->task.time()));
+    if (layer.next.empty() && !chunked && layer.data.pointer().use_count() == 1) {
+      // no pull holds the current version, update it in place
+      CHECK_NOTNULL(updater_)->Update(
+          key, data_kr.size(), recv_data.data(), layer.data.data() + offset);
+      return;
+    }
+
+    // copy on write, pulls still get the current version meanwhile. the copy
+    // is made once and shared by all chunks
+    SArray<V> cur = layer.data;
+    l.unlock();
+    if (layer.next.empty()) layer.next.CopyFrom(cur);
+    CHECK_NOTNULL(updater_)->Update(
+        key, data_kr.size(), recv_data.data(), layer.next.data() + offset);
+    if (chunked) {
+      if (!LastChunk(msg)) return;
+      layer.writing.erase(std::make_pair(msg->sender, msg->task.time()));
+    }
+    if (layer.writing.empty()) {
+      l.lock();
+      layer.data = layer.next;
+      l.unlock();
+      layer.next = SArray<V>();
+    }
   }
 }
 
@@ -1,8 +1,15 @@
 #pragma once
 #include "ps.h"
 #include "parameter/parameter.h"
+#include "parameter/checkpoint.h"
+#include "util/parallel_pool.h"
+#include "util/sharded_hash_map.h"
 namespace PS {
 
+DECLARE_int32(num_replicas);
+DECLARE_int32(replica_interval);
+DECLARE_int32(replica_batch);
+
 /**
  * @brief Default entry type for KVMap
  */
@@ -15,23 +22,44 @@ struct KVMapEntry {
 
 /**
  * @brief Default state type for KVMap
+ *
+ * The entries are updated by multiple threads, each of them is given a state
+ * created by Local(), which are merged back into the global state by Merge()
+ * before Update() is called. Merge() and Update() are called under a lock.
  */
 struct KVMapState {
   void Update() { }
+  KVMapState Local() const { return KVMapState(); }
+  void Merge(const KVMapState& local) { }
 };
 
 /**
  * @brief A key-value store with fixed length value.
  *
+ * If -num_replicas > 0, a server logs the pushes it applied, and a background
+ * thread ships the log to the replica group every -replica_interval
+ * milliseconds or once it has -replica_batch keys, so replication does not
+ * block pushes unless the log has twice that many keys. A replica node replays
+ * the pushes by R::Set, so a replica lags behind its owner by up to one
+ * shipment. A server replacing a dead one loads the replica of its key range
+ * by PullReplica, see TakeOver.
+ *
+ * Replaying a push on a replica only gives the owner's values if R::Set
+ * assigns them, as KVMapEntry does, since the replica has neither the owner's
+ * entries nor its state. An entry accumulating the pushed values, such as a
+ * gradient, should log its new values instead, with an R assigning them, see
+ * LM::AsyncSGDServer::Model.
  *
  * @tparam K the key type
  * @tparam V the value type
  * @tparam E the entry type
  * @tparam S the state type
+ * @tparam R the entry type of the replicas
  */
 template <typename K, typename V,
           typename E = KVMapEntry<V>,
-          typename S = KVMapState>
+          typename S = KVMapState,
+          typename R = E>
 class KVMap : public Parameter {
  public:
   /**
@@ -43,65 +71,335 @@ class KVMap : public Parameter {
   KVMap(int k = 1, int id = NextCustomerID()) :
       Parameter(id), k_(k) {
     CHECK_GT(k, 0);
+    if (FLAGS_num_replicas > 0 && IsServer()) {
+      log_thread_ = std::thread(&KVMap::ShipLog, this);
+    }
+  }
+  virtual ~KVMap() {
+    if (log_thread_.joinable()) {
+      {
+        Lock l(log_mu_);
+        log_done_ = true;
+      }
+      log_cond_.notify_one();
+      log_space_cond_.notify_all();
+      log_thread_.join();
+    }
   }
-  virtual ~KVMap() { }
 
   void set_state(const S& s) { state_ = s; }
 
   virtual void Slice(const Message& request, const std::vector<Range<Key>>& krs,
                      std::vector<Message*>* msgs) {
+    if (request.task.param().replica()) {
+      // not sliced by key ranges. a push goes to every replica node, and a pull
+      // goes to the nearest one
+      bool push = request.task.param().push();
+      for (size_t i = 0; i < msgs->size(); ++i) {
+        Message* msg = (*msgs)[i];
+        msg->valid = push || i == 0;
+        if (!msg->valid) continue;
+        msg->key = request.key;
+        msg->value = request.value;
+      }
+      return;
+    }
     SliceKOFVMessage<K>(request, krs, msgs);
   }
+  virtual void Chunk(const Message& msg, size_t max_bytes,
+                     std::vector<Message*>* chunks) {
+    ChunkKOFVMessage<K>(msg, max_bytes, chunks);
+  }
 
   virtual void GetValue(Message* msg);
   virtual void SetValue(const Message* msg);
 
+  virtual void SetReplica(const Message* msg);
+  virtual void GetReplica(Message* msg);
+  virtual void Recover(Message* msg);
+
   virtual void WriteToFile(std::string file);
 
+  /// @brief Writes all entries, the values are got by E::Get
+  virtual void SaveCheckpoint(std::string file);
+  /// @brief Sets the entries by E::Set with the values in the checkpoint
+  virtual void LoadCheckpoint(std::string file);
+
  protected:
+  // calls func(i, &entry, state) for each key[i] by up to -num_threads
+  // threads. each thread works on its own shards of data_ with a local state.
+  // concurrent calls on the same shards are serialized by the shard locks
+  template <typename F> void Batch(const SArray<K>& key, F func);
+
+  /// @brief Returns true if the pushes should be logged for the replicas
+  bool logging() const { return log_thread_.joinable(); }
+  /// @brief Appends a copy of a push with k values per key to the log shipped
+  /// to the replica group. It blocks while the log is full
+  void Log(const SArray<K>& key, const SArray<V>& val);
+
   int k_;
   S state_;
-  // TODO use multi-thread cuokoo hash
-  std::unordered_map<K, E> data_;
+  // protects state_, which is shared by the requests on different executor
+  // threads
+  std::mutex state_mu_;
+  ShardedHashMap<K, E> data_;
+
+  // the replica of an owner node, updated by replaying its pushes
+  struct Replica {
+    Range<Key> key_range;
+    ShardedHashMap<K, R> data;
+    S state;
+  };
+  std::unordered_map<NodeID, std::unique_ptr<Replica>> replicas_;
+  std::mutex replica_mu_;  // protects the structure of replicas_
+
+  // the pushes applied but not shipped to the replica group yet, in order.
+  // copied, a received buffer may be a block of a shared memory ring, which
+  // is not reused until released
+  SArray<K> log_key_;
+  SArray<V> log_val_;
+  bool log_done_ = false;
+  std::mutex log_mu_;
+  std::condition_variable log_cond_;
+  // notified once the log is swapped out
+  std::condition_variable log_space_cond_;
+  std::thread log_thread_;
+  // the thread shipping the log
+  void ShipLog();
 };
 
-template <typename K, typename V, typename E, typename S>
-void KVMap<K,V,E,S>::GetValue(Message* msg) {
+template <typename K, typename V, typename E, typename S, typename R>
+void KVMap<K,V,E,S,R>::GetValue(Message* msg) {
   SArray<K> key(msg->key);
   size_t n = key.size();
   SArray<V> val(n * k_);
-  for (size_t i = 0; i < n; ++i) {
-    data_[key[i]].Get(val.data() + i * k_, &state_);
-  }
+  Batch(key, [this, &val](size_t i, E* e, S* state) {
+      e->Get(val.data() + i * k_, state);
+    });
   msg->add_value(val);
 }
 
-template <typename K, typename V, typename E, typename S>
-void KVMap<K,V,E,S>::SetValue(const Message* msg) {
+template <typename K, typename V, typename E, typename S, typename R>
+void KVMap<K,V,E,S,R>::SetValue(const Message* msg) {
   SArray<K> key(msg->key);
   size_t n = key.size();
   CHECK_EQ(msg->value.size(), 1);
   SArray<V> val(msg->value[0]);
   CHECK_EQ(n * k_, val.size());
 
-  for (size_t i = 0; i < n; ++i) {
-    data_[key[i]].Set(val.data() + i * k_, &state_);
+  Batch(key, [this, &val](size_t i, E* e, S* state) {
+      e->Set(val.data() + i * k_, state);
+    });
+  // update once per request, after all its chunks are applied
+  if (this->LastChunk(msg)) {
+    Lock l(state_mu_);
+    state_.Update();
+  }
+
+  if (logging()) Log(key, val);
+}
+
+template <typename K, typename V, typename E, typename S, typename R>
+void KVMap<K,V,E,S,R>::Log(const SArray<K>& key, const SArray<V>& val) {
+  bool full;
+  {
+    std::unique_lock<std::mutex> lk(log_mu_);
+    // backpressure, wait for the shipping thread rather than let the log grow
+    // when the replicas fall behind
+    log_space_cond_.wait(lk, [this]() {
+        return log_done_ || log_key_.size() < 2 * (size_t)FLAGS_replica_batch;
+      });
+    // append grows an array to the exact size, so reserve a full log at once
+    size_t n = std::max(log_key_.size() + key.size(),
+                        2 * (size_t)FLAGS_replica_batch);
+    log_key_.reserve(n);
+    log_val_.reserve(n * k_);
+    log_key_.append(key);
+    log_val_.append(val);
+    full = log_key_.size() >= (size_t)FLAGS_replica_batch;
+  }
+  if (full) log_cond_.notify_one();
+}
+
+template <typename K, typename V, typename E, typename S, typename R>
+void KVMap<K,V,E,S,R>::ShipLog() {
+  while (true) {
+    SArray<K> key;
+    SArray<V> val;
+    {
+      std::unique_lock<std::mutex> lk(log_mu_);
+      log_cond_.wait_for(
+          lk, std::chrono::milliseconds(FLAGS_replica_interval), [this]() {
+            return log_done_ || log_key_.size() >= (size_t)FLAGS_replica_batch;
+          });
+      if (log_key_.empty()) {
+        if (log_done_) return;
+        continue;
+      }
+      key = log_key_; log_key_.clear();
+      val = log_val_; log_val_.clear();
+    }
+    log_space_cond_.notify_all();
+
+    // a replica replays the pushes in the order of the log
+    Message push(Request(0, Message::kInvalidTime, {}, Filters(), MyKeyRange()),
+                 kReplicaGroup);
+    push.task.mutable_param()->set_replica(true);
+    push.set_key(key);
+    push.add_value(val);
+    Push(&push);
+    VLOG(1) << "shipped " << key.size() << " keys to the replicas";
+  }
+}
+
+template <typename K, typename V, typename E, typename S, typename R>
+void KVMap<K,V,E,S,R>::SetReplica(const Message* msg) {
+  SArray<K> key(msg->key);
+  if (key.empty()) return;
+  CHECK_EQ(msg->value.size(), 1);
+  SArray<V> val(msg->value[0]);
+  CHECK_EQ(key.size() * k_, val.size());
+  Replica* r;
+  {
+    Lock l(replica_mu_);
+    Range<Key> kr(msg->task.key_range());
+    auto& p = replicas_[msg->sender];
+    if (!p) {
+      // a node replacing a dead owner continues the replica of the dead one
+      for (auto it = replicas_.begin(); it != replicas_.end(); ++it) {
+        if (it->second && it->first != msg->sender &&
+            it->second->key_range == kr) {
+          p = std::move(it->second);
+          replicas_.erase(it);
+          break;
+        }
+      }
+    }
+    if (!p) {
+      p = std::unique_ptr<Replica>(new Replica());
+      p->state = state_.Local();
+    }
+    p->key_range = kr;
+    r = p.get();
+  }
+  // a single thread, so the pushes of a key are replayed in order
+  r->data.Batch(key.data(), key.size(), [this, r, &val](size_t i, R* e) {
+      e->Set(val.data() + i * k_, &r->state);
+    });
+}
+
+template <typename K, typename V, typename E, typename S, typename R>
+void KVMap<K,V,E,S,R>::GetReplica(Message* msg) {
+  // the owner may be replaced by a new node, so find it by the key range
+  Range<Key> kr(msg->task.key_range());
+  Replica* r = nullptr;
+  {
+    Lock l(replica_mu_);
+    for (auto& it : replicas_) {
+      if (it.second->key_range == kr) r = it.second.get();
+    }
+  }
+  SArray<K> key;
+  SArray<V> val;
+  if (r) {
+    // the owner may push meanwhile, so the arrays grow with the walk
+    size_t m = r->data.size();
+    key.reserve(m);
+    val.reserve(m * k_);
+    std::vector<V> v(k_);
+    r->data.ForEach([this, r, &key, &val, &v](K k, R& e) {
+        key.push_back(k);
+        e.Get(v.data(), &r->state);
+        for (int j = 0; j < k_; ++j) val.push_back(v[j]);
+      });
+  } else {
+    LOG(WARNING) << MyNodeID() << " has no replica of " << kr;
+  }
+  msg->set_key(key);
+  msg->add_value(val);
+}
+
+template <typename K, typename V, typename E, typename S, typename R>
+void KVMap<K,V,E,S,R>::Recover(Message* msg) {
+  SArray<K> key(msg->key);
+  if (key.empty()) return;
+  CHECK_EQ(msg->value.size(), 1);
+  SArray<V> val(msg->value[0]);
+  CHECK_EQ(key.size() * k_, val.size());
+  Batch(key, [this, &val](size_t i, E* e, S* state) {
+      e->Set(val.data() + i * k_, state);
+    });
+  LOG(INFO) << MyNodeID() << " recovered " << key.size() << " keys from "
+            << msg->sender;
+}
+
+template <typename K, typename V, typename E, typename S, typename R>
+template <typename F>
+void KVMap<K,V,E,S,R>::Batch(const SArray<K>& key, F func) {
+  // not worth a parallel loop for a few keys
+  const size_t kMinKeys = 10000;
+  int nt = (int)std::max((size_t)1, std::min(
+      (size_t)FLAGS_num_threads, key.size() / kMinKeys));
+  std::vector<S> states;
+  {
+    Lock l(state_mu_);
+    for (int t = 0; t < nt; ++t) states.push_back(state_.Local());
   }
-  state_.Update();
+  ParallelPool::instance().Run(nt, [this, &key, &func, &states, nt](int t) {
+      S* state = &states[t];
+      data_.Batch(key.data(), key.size(), [&func, state](size_t i, E* e) {
+          func(i, e, state);
+        }, t, nt);
+    });
+  Lock l(state_mu_);
+  for (const auto& s : states) state_.Merge(s);
 }
 
-template <typename K, typename V, typename E, typename S>
-void KVMap<K,V,E,S>::WriteToFile(std::string file) {
+template <typename K, typename V, typename E, typename S, typename R>
+void KVMap<K,V,E,S,R>::WriteToFile(std::string file) {
   if (!dirExists(getPath(file))) {
     createDir(getPath(file));
   }
   std::ofstream out(file); CHECK(out.good());
   V v;
-  for (auto& e : data_) {
-    e.second.Get(&v, &state_);
-    if (v != 0) out << e.first << "\t" << v << std::endl;
-  }
+  data_.ForEach([this, &out, &v](K key, E& e) {
+      e.Get(&v, &state_);
+      if (v != 0) out << key << "\t" << v << std::endl;
+    });
+}
+
+template <typename K, typename V, typename E, typename S, typename R>
+void KVMap<K,V,E,S,R>::SaveCheckpoint(std::string file) {
+  // pushes may insert keys meanwhile, so the arrays grow with the walk
+  size_t m = data_.size();
+  SArray<K> key; key.reserve(m);
+  SArray<V> val; val.reserve(m * k_);
+  std::vector<V> v(k_);
+  data_.ForEach([this, &key, &val, &v](K k, E& e) {
+      key.push_back(k);
+      e.Get(v.data(), &state_);
+      for (int j = 0; j < k_; ++j) val.push_back(v[j]);
+    });
+  SortKeyValue(&key, &val, k_);
+  CheckpointWriter<K, V> writer;
+  writer.Add(0, key, val, k_);
+  CHECK(writer.Write(file));
 }
 
+template <typename K, typename V, typename E, typename S, typename R>
+void KVMap<K,V,E,S,R>::LoadCheckpoint(std::string file) {
+  CheckpointReader<K, V> reader;
+  CHECK(reader.Open(file));
+  for (int i = 0; i < reader.num_segments(); ++i) {
+    const auto& seg = reader.segment(i);
+    CHECK_EQ(seg.k, k_);
+    CHECK(seg.key) << "a dense checkpoint";
+    // no copy, the keys are valid until reader is closed
+    SArray<K> key(const_cast<K*>(seg.key), seg.n, false);
+    Batch(key, [this, &seg](size_t i, E* e, S* state) {
+        e->Set(seg.value + i * k_, state);
+      });
+  }
+}
 
 }  // namespace PS
@@ -1,8 +1,10 @@
 #pragma once
 #include "ps.h"
 #include "parameter/parameter.h"
+#include "parameter/checkpoint.h"
 #include "util/parallel_ordered_match.h"
 #include "filter/frequency_filter.h"
+DECLARE_int32(num_executor_threads);
 namespace PS {
 // TODO doc, and filter
 /**
@@ -23,6 +25,11 @@ namespace PS {
  * order. However, it is efficient only when insert bulk (key,value) pairs each
  * time.
  *
+ * Keys pushed without values are kept as sorted runs, where a run is merged
+ * with the previous one if that one is not twice larger, so inserting n keys
+ * costs O(n log n) in total. The runs are merged into the key array, with the
+ * existing values kept, when the channel is accessed next time.
+ *
  * It supports multiple channels. Communication is isolated between
  * channels. For example, we can sent a pull request on channel 1 and 2 at same
  * time, then the pulled results will be store at channel 1 and 2,
@@ -53,11 +60,16 @@ class KVVector : public Parameter {
   };
 
   /// @brief Returns the key-vale pairs in channel "chl"
-  KVPairs& operator[] (int chl) { Lock l(mu_); return data_[chl]; }
+  KVPairs& operator[] (int chl) {
+    Lock l(ChannelMutex(chl)); Compact(chl);
+    Lock l2(mu_); return data_[chl];
+  }
 
   /// @brief Clears both key and value at channel "chl"
   void Clear(int chl) {
-    Lock l(mu_); data_[chl].key.clear(); data_[chl].value.clear();
+    Lock l(ChannelMutex(chl));
+    Lock l2(mu_); data_[chl].key.clear(); data_[chl].value.clear();
+    runs_.erase(chl);
   }
 
   /// @brief buffer for received data
@@ -67,11 +79,25 @@ class KVVector : public Parameter {
     std::vector<SArray<V>> values;
   };
 
-  /// @brief Returns the buffered data on timestamp
-  Buffer buffer(int timestamp) { Lock l(mu_); return buffer_[timestamp]; }
+  /**
+   * @brief Returns the buffered data on timestamp
+   *
+   * The data received by different executor threads are summed into different
+   * stripes, which are reduced here. So it should be called after all data are
+   * received, such as after WaitReceivedRequest.
+   */
+  Buffer buffer(int timestamp) {
+    Lock l(mu_);
+    auto& buf = buffer_[timestamp];
+    Reduce(&buf);
+    return buf.sum;
+  }
 
   void ClearBuffer(int timestamp) {
-    for (auto& v : buffer_[timestamp].values) v.clear();
+    Lock l(mu_);
+    auto& buf = buffer_[timestamp];
+    for (auto& v : buf.sum.values) v.clear();
+    for (auto& s : buf.stripes) for (auto& v : s) v.clear();
   }
 
   void ClearFilter() { freq_filter_.clear(); }
@@ -103,23 +129,85 @@ class KVVector : public Parameter {
   int Pull(const Task& request, const SArray<K>& keys,
            const Message::Callback& callback = Message::Callback());
 
+  /**
+   * @brief The same as Push, but returns a future finished once the push is
+   * finished
+   */
+  Future PushAsync(const Task& request,
+                   const SArray<K>& keys,
+                   const std::initializer_list<SArray<V>>& values = {});
+
+  /**
+   * @brief The same as Pull, but returns a future finished once the pulled
+   * data is received
+   */
+  Future PullAsync(const Task& request, const SArray<K>& keys);
+
 
   virtual void Slice(const Message& request, const std::vector<Range<Key>>& krs,
                      std::vector<Message*>* msgs) {
     SliceKOFVMessage<K>(request, krs, msgs);
   }
+  virtual void Chunk(const Message& msg, size_t max_bytes,
+                     std::vector<Message*>* chunks) {
+    ChunkKOFVMessage<K>(msg, max_bytes, chunks);
+  }
+  /// @brief Buffered pushes are summed into separate stripes, so pushes from
+  /// different workers are processed in parallel
+  virtual bool Concurrent(const Message& request) {
+    const auto& call = request.task.param();
+    return buffer_value_ && call.push() && !call.replica() &&
+        !call.has_tail_filter() && request.task.value_type_size() > 0;
+  }
   virtual void GetValue(Message* msg);
   virtual void SetValue(const Message* msg);
+
+  /// @brief Writes the channels with values, one segment per channel
+  virtual void SaveCheckpoint(std::string file);
+  /// @brief Replaces the channels in the checkpoint by its data
+  virtual void LoadCheckpoint(std::string file);
+
   using Parameter::Push;
   using Parameter::Pull;
+  using Parameter::PushAsync;
+  using Parameter::PullAsync;
  protected:
   int k_;  // value entry size
   std::unordered_map<int, KVPairs> data_;  // <channel, KVPairs>
 
   bool buffer_value_;
-  std::unordered_map<int, Buffer> buffer_;  // <channel, Buffer>
+  // the data received on a timestamp. a push locks one of the stripes and sums
+  // its data into it, so pushes on different threads do not wait for each
+  // other. the stripes are summed into stripes[0] when read
+  struct StripedBuffer {
+    Buffer sum;
+    std::vector<std::vector<SArray<V>>> stripes;
+    std::vector<std::mutex> locks;
+  };
+  std::unordered_map<int, StripedBuffer> buffer_;  // <timestamp, buffer>
+  // sums the stripes of "buf" into buf->sum. must hold mu_
+  void Reduce(StripedBuffer* buf);
+
+  // protect the structure of data_, runs_, buffer_ and chl_mu_. it is held
+  // briefly, the keys are merged under the lock of their channel
+  std::mutex mu_;
+
+  // <channel, the lock serializing the changes of its keys>, which is taken
+  // before mu_
+  std::unordered_map<int, std::unique_ptr<std::mutex>> chl_mu_;
+  std::mutex& ChannelMutex(int chl) {
+    Lock l(mu_);
+    auto& m = chl_mu_[chl];
+    if (!m) m = std::unique_ptr<std::mutex>(new std::mutex());
+    return *m;
+  }
 
-  std::mutex mu_;  // protect the structure of data_ and buffer_
+  // <channel, the sorted runs of pushed keys not merged into data_ yet>
+  std::unordered_map<int, std::vector<SArray<K>>> runs_;
+  // adds "key" into the runs of "chl". must hold the lock of "chl"
+  void InsertKeys(int chl, const SArray<K>& key);
+  // merges the runs of "chl" into data_[chl]. must hold the lock of "chl"
+  void Compact(int chl);
 
   // <channel, filter tail keys>
   std::unordered_map<int, FreqencyFilter<Key, uint8>> freq_filter_;
@@ -152,62 +240,120 @@ void KVVector<K,V>::SetValue(const Message* msg) {
     return;
   }
 
-  mu_.lock();
-  auto& kv = data_[chl];
-  mu_.unlock();
-
   if (msg->value.size() == 0) {
-    // only has keys. merge these keys
-    kv.key = kv.key.SetUnion(recv_key);
-    // clear the values, because they are not matched any more
-    kv.value.clear();
-    VLOG(1) << "merge keys, now the key size is " << kv.key.size();
+    // only has keys. merge them later
+    Lock l(ChannelMutex(chl));
+    InsertKeys(chl, recv_key);
     return;
-  } else if (kv.key.empty()) {
+  }
+
+  KVPairs* p;
+  {
+    Lock l(ChannelMutex(chl));
+    Compact(chl);
+    Lock l2(mu_);
+    p = &data_[chl];
+  }
+  auto& kv = *p;
+
+  if (kv.key.empty()) {
     LOG(ERROR) << "empty keys at channel " << msg->task.key_channel();
     return;
   }
 
+  if (!buffer_value_) {
+    // write the received value into kv.value directly
+    CHECK_EQ(msg->value.size(), 1) << " can only receive one value";
+    SArray<V> recv_data(msg->value[0]);
+    CHECK_EQ(recv_data.size(), recv_key.size() * k_);
+    if (kv.value.empty()) {
+      kv.value = SArray<V>(kv.key.size() * k_, 0);
+    }
+    CHECK_EQ(kv.key.size() * k_, kv.value.size());
+
+    size_t n = ParallelOrderedMatch(
+        recv_key, recv_data, kv.key, &kv.value, k_, AssignOpType::PLUS);
+    CHECK_EQ(n, recv_key.size() * k_);
+    VLOG(1) << "matched " << n << " keys";
+    return;
+  }
+
+  // match the received values, then sum them into a stripe of the buffer
+  SizeR idx_range = kv.key.FindRange(Range<K>(msg->task.key_range()));
+  StripedBuffer* buf;
+  {
+    Lock l(mu_);
+    buf = &buffer_[msg->task.time()];
+    if (buf->stripes.empty()) {
+      // "msg" comes from the first nodes in this channel, allocate memory first
+      int n = std::max(FLAGS_num_executor_threads, 1);
+      buf->stripes.resize(n);
+      for (auto& s : buf->stripes) s.resize(msg->value.size());
+      buf->locks = std::vector<std::mutex>(n);
+      buf->sum.values.resize(msg->value.size());
+      buf->sum.idx_range = idx_range;
+      buf->sum.channel = chl;
+    } else {
+      CHECK_EQ(buf->sum.idx_range, idx_range);
+      CHECK_EQ(buf->sum.channel, chl);
+      CHECK_EQ(buf->sum.values.size(), msg->value.size());
+    }
+  }
+
+  // take a free stripe, starting from the one of this thread
+  int ns = (int)buf->locks.size();
+  int s = std::hash<std::thread::id>()(std::this_thread::get_id()) % ns;
+  std::unique_lock<std::mutex> lk(buf->locks[s], std::try_to_lock);
+  for (int j = 1; j < ns && !lk.owns_lock(); ++j) {
+    int t = (s + j) % ns;
+    lk = std::unique_lock<std::mutex>(buf->locks[t], std::try_to_lock);
+    if (lk.owns_lock()) s = t;
+  }
+  if (!lk.owns_lock()) lk = std::unique_lock<std::mutex>(buf->locks[s]);
+
+  auto& stripe = buf->stripes[s];
   for (int i = 0; i < msg->value.size(); ++i) {
     SArray<V> recv_data(msg->value[i]);
-    if (!buffer_value_) {
-      // write the received value into kv.value directly
-      CHECK_EQ(i, 0) << " can only receive one value";
-      CHECK_EQ(recv_data.size(), recv_key.size() * k_);
-      if (kv.value.empty()) {
-        kv.value = SArray<V>(kv.key.size() * k_, 0);
-      }
-      CHECK_EQ(kv.key.size() * k_, kv.value.size());
+    size_t k = recv_data.size() / recv_key.size();  // not necessary == k_
+    size_t n = ParallelOrderedMatch(
+        recv_key, recv_data, kv.key.Segment(idx_range), &stripe[i], k,
+        AssignOpType::PLUS);
+    CHECK_LE(n, recv_key.size() * k);
+    VLOG(1) << "matched " << n << " keys into stripe " << s;
+  }
+}
 
-      size_t n = ParallelOrderedMatch(
-          recv_key, recv_data, kv.key, &kv.value, k_, AssignOpType::PLUS);
-      CHECK_EQ(n, recv_key.size() * k_);
-      VLOG(1) << "matched " << n << " keys";
-    } else {
-      // match the received value, then save it
-      mu_.lock();
-      auto& buf = buffer_[msg->task.time()];
-      mu_.unlock();
-
-      if (i == 0) {
-        SizeR idx_range = kv.key.FindRange(Range<K>(msg->task.key_range()));
-        if (buf.values.size() == 0) {
-          // "msg" comes from the first nodes in this channel, allocate memory first
-          buf.values.resize(msg->value.size());
-          buf.idx_range = idx_range;
-          buf.channel = chl;
-        } else {
-          CHECK_EQ(buf.idx_range, idx_range);
-          CHECK_EQ(buf.channel, chl);
-        }
+template <typename K, typename V>
+void KVVector<K,V>::Reduce(StripedBuffer* buf) {
+  int ns = (int)buf->stripes.size();
+  if (ns == 0) return;
+  std::vector<std::unique_lock<std::mutex>> lks;
+  for (auto& m : buf->locks) lks.push_back(std::unique_lock<std::mutex>(m));
+
+  for (size_t i = 0; i < buf->sum.values.size(); ++i) {
+    // sum into stripes[0] in place
+    auto& sum = buf->stripes[0][i];
+    for (int s = 1; s < ns; ++s) {
+      auto& v = buf->stripes[s][i];
+      if (v.empty()) continue;
+      if (sum.empty()) {
+        sum = v;
+      } else {
+        CHECK_EQ(sum.size(), v.size());
+        const size_t kChunk = 1 << 16;
+        size_t n = v.size();
+        int np = (int)std::min<size_t>(
+            std::max(FLAGS_num_threads, 1), (n + kChunk - 1) / kChunk);
+        V* a = sum.begin();
+        const V* b = v.begin();
+        ParallelPool::instance().Run(np, [a, b, n, np](int p) {
+            size_t end = n * (p + 1) / np;
+            for (size_t j = n * p / np; j < end; ++j) a[j] += b[j];
+          });
       }
-      size_t k = recv_data.size() / recv_key.size();  // not necessary == k_
-      size_t n = ParallelOrderedMatch(
-          recv_key, recv_data, kv.key.Segment(buf.idx_range), &buf.values[i], k,
-          AssignOpType::PLUS);
-      CHECK_LE(n, recv_key.size() * k);
-      VLOG(1) << "matched " << n << " keys";
+      v.clear();
     }
+    buf->sum.values[i] = sum;
   }
 }
 
@@ -228,8 +374,13 @@ void KVVector<K,V>::GetValue(Message* msg) {
     return;
   }
 
-  Lock l(mu_);
-  auto& kv = data_[chl];
+  Lock l(ChannelMutex(chl));
+  Compact(chl);
+  KVPairs kv;
+  {
+    Lock l2(mu_);
+    kv = data_[chl];
+  }
   CHECK_EQ(kv.key.size() * k_, kv.value.size());
 
   // get the data
@@ -241,6 +392,102 @@ void KVVector<K,V>::GetValue(Message* msg) {
   msg->add_value(val);
 }
 
+template <typename K, typename V>
+void KVVector<K,V>::InsertKeys(int chl, const SArray<K>& key) {
+  if (key.empty()) return;
+  std::vector<SArray<K>>* runs;
+  {
+    // the element is not moved by other insertions, and is not erased without
+    // the lock of "chl"
+    Lock l(mu_);
+    runs = &runs_[chl];
+  }
+  SArray<K> run = key;
+  while (!runs->empty() && runs->back().size() <= run.size() * 2) {
+    run = runs->back().SetUnion(run);
+    runs->pop_back();
+  }
+  runs->push_back(run);
+  VLOG(1) << "insert " << key.size() << " keys, now there are "
+          << runs->size() << " runs";
+}
+
+template <typename K, typename V>
+void KVVector<K,V>::Compact(int chl) {
+  // swap the runs out, and merge them without mu_
+  std::vector<SArray<K>> runs;
+  KVPairs kv;
+  {
+    Lock l(mu_);
+    auto it = runs_.find(chl);
+    if (it == runs_.end()) return;
+    runs.swap(it->second);
+    runs_.erase(it);
+    kv = data_[chl];
+  }
+  // merge from the smallest one
+  SArray<K> key;
+  for (int i = (int)runs.size() - 1; i >= 0; --i) {
+    key = key.empty() ? runs[i] : runs[i].SetUnion(key);
+  }
+
+  SArray<K> new_key = kv.key.SetUnion(key);
+  SArray<V> new_value;
+  if (!kv.value.empty() && kv.key.size() * k_ == kv.value.size()) {
+    // move the values to the new positions of their keys
+    new_value = SArray<V>(new_key.size() * k_, 0);
+    ParallelOrderedMatch(kv.key, kv.value, new_key, &new_value, k_);
+  }
+  {
+    Lock l(mu_);
+    data_[chl].key = new_key;
+    data_[chl].value = new_value;
+  }
+  VLOG(1) << "merge keys, now the key size is " << new_key.size();
+}
+
+template <typename K, typename V>
+void KVVector<K,V>::SaveCheckpoint(std::string file) {
+  CheckpointWriter<K, V> writer;
+  std::vector<int> chls;
+  {
+    Lock l(mu_);
+    for (const auto& it : data_) chls.push_back(it.first);
+    for (const auto& it : runs_) chls.push_back(it.first);
+  }
+  std::sort(chls.begin(), chls.end());
+  chls.resize(std::unique(chls.begin(), chls.end()) - chls.begin());
+  for (int chl : chls) {
+    Lock l(ChannelMutex(chl));
+    Compact(chl);
+    KVPairs kv;
+    {
+      Lock l2(mu_);
+      kv = data_[chl];
+    }
+    if (kv.key.empty() || kv.value.size() != kv.key.size() * k_) continue;
+    writer.Add(chl, kv.key, kv.value, k_);
+  }
+  CHECK(writer.Write(file));
+}
+
+template <typename K, typename V>
+void KVVector<K,V>::LoadCheckpoint(std::string file) {
+  CheckpointReader<K, V> reader;
+  CHECK(reader.Open(file));
+  for (int i = 0; i < reader.num_segments(); ++i) {
+    const auto& seg = reader.segment(i);
+    CHECK_EQ(seg.k, k_);
+    CHECK(seg.key) << "a dense checkpoint";
+    Lock l(ChannelMutex(seg.channel));
+    Lock l2(mu_);
+    auto& kv = data_[seg.channel];
+    kv.key.CopyFrom(seg.key, seg.n);
+    kv.value.CopyFrom(seg.value, seg.n * k_);
+    runs_.erase(seg.channel);
+  }
+}
+
 template <typename K, typename V>
 int KVVector<K,V>::Push(const Task& request, const SArray<K>& keys,
                         const std::initializer_list<SArray<V>>& values,
@@ -261,4 +508,20 @@ int KVVector<K,V>::Pull(const Task& request, const SArray<K>& keys,
   return Pull(&pull);
 }
 
+template <typename K, typename V>
+Future KVVector<K,V>::PushAsync(const Task& request, const SArray<K>& keys,
+                                const std::initializer_list<SArray<V>>& values) {
+  Message push(request, kServerGroup);
+  push.set_key(keys);
+  for (const auto& v : values) if (!v.empty()) push.add_value(v);
+  return PushAsync(&push);
+}
+
+template <typename K, typename V>
+Future KVVector<K,V>::PullAsync(const Task& request, const SArray<K>& keys) {
+  Message pull(request, kServerGroup);
+  pull.set_key(keys);
+  return PullAsync(&pull);
+}
+
 }  // namespace PS
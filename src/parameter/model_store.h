@@ -0,0 +1,144 @@
+#pragma once
+#include "parameter/checkpoint.h"
+namespace PS {
+
+/**
+ * @brief A read-only key-value store for serving a trained model, such as
+ * scoring examples with the weights saved by servers.
+ *
+ * The pairs are kept in a single array in the Eytzinger order, namely the
+ * breadth-first order of a complete binary search tree, with a value next to
+ * its key. The first levels of the tree, which are visited by every lookup,
+ * stay in cache, and the children of a node are next to each other, so they
+ * can be prefetched before the node is compared. A batch of lookups goes down
+ * the tree in lockstep, so the cache misses of different keys overlap.
+ *
+ * Sample usage:
+ *   ModelStore<Key, float> store;
+ *   for (auto& f : files) CHECK(store.AddCheckpoint(f));
+ *   store.Build();
+ *   store.Get(key.data(), key.size(), weight.data());
+ */
+template <typename K, typename V>
+class ModelStore {
+ public:
+  ModelStore() { }
+  ~ModelStore() { }
+
+  /**
+   * @brief Adds the pairs in a checkpoint written by Parameter::SaveCheckpoint
+   *
+   * @param file the checkpoint
+   * @param col the value of a key is the col-th one of its k values, e.g. the
+   * weight in an async SGD checkpoint
+   * @param skip_zero do not add zero values, which are the same as missing
+   * keys in Get
+   */
+  bool AddCheckpoint(const std::string& file, int col = 0,
+                     bool skip_zero = true) {
+    CheckpointReader<K, V> reader;
+    if (!reader.Open(file)) return false;
+    for (int s = 0; s < reader.num_segments(); ++s) {
+      const auto& seg = reader.segment(s);
+      CHECK_LT(col, seg.k);
+      for (size_t i = 0; i < seg.n; ++i) {
+        V v = seg.value[i * seg.k + col];
+        if (skip_zero && v == 0) continue;
+        Entry e; e.key = seg.key_at(i); e.value = v;
+        pending_.push_back(e);
+      }
+    }
+    return true;
+  }
+
+  /// @brief Adds a pair. If a key is added more than once, one of the values
+  /// is kept
+  void Add(K key, V value) {
+    Entry e; e.key = key; e.value = value;
+    pending_.push_back(e);
+  }
+
+  /// @brief Builds the store with the added pairs. It should be called before
+  /// lookups
+  void Build() {
+    ParallelSort(&pending_, std::max(FLAGS_num_threads, 1),
+                 [](const Entry& a, const Entry& b) { return a.key < b.key; });
+    size_t n = 0;
+    for (size_t i = 0; i < pending_.size(); ++i) {
+      if (n == 0 || pending_[n-1].key < pending_[i].key) {
+        pending_[n++] = pending_[i];
+      }
+    }
+    // entries_[0] is not used, so the children of node i are 2i and 2i+1
+    n_ = n;
+    entries_.resize(n + 1);
+    size_t j = 0;
+    Fill(pending_.data(), &j, 1);
+    CHECK_EQ(j, n);
+    depth_ = 0;
+    while (((size_t)1 << depth_) <= n_) ++ depth_;
+    pending_.clear();
+    VLOG(1) << "built a model store with " << n_ << " keys";
+  }
+
+  /// @brief Returns the number of keys
+  size_t size() const { return n_; }
+
+  /// @brief Returns the value of "key", or "miss" if not found
+  V Get(K key, V miss = 0) const {
+    V v; Get(&key, 1, &v, miss); return v;
+  }
+
+  /**
+   * @brief Sets value[i] to the value of key[i], or "miss" if not found
+   */
+  void Get(const K* key, size_t n, V* value, V miss = 0) const {
+    const size_t kGroup = 16;
+    size_t pos[kGroup];
+    const Entry* e = entries_.data();
+    for (size_t i = 0; i < n; i += kGroup) {
+      size_t m = std::min(kGroup, n - i);
+      for (size_t j = 0; j < m; ++j) pos[j] = 1;
+      for (int d = 0; d < depth_; ++d) {
+        for (size_t j = 0; j < m; ++j) {
+          size_t p = pos[j];
+          // the descendants 4 levels deeper are contiguous, so fetch them
+          // before they are needed
+          __builtin_prefetch(e + std::min(p * kPrefetch, n_));
+          // go right once past the leaves, which keeps the answer below
+          pos[j] = 2 * p + (p > n_ || e[p].key < key[i + j]);
+        }
+      }
+      for (size_t j = 0; j < m; ++j) {
+        // the last node where the search went left, namely the lower bound
+        size_t p = pos[j] >> __builtin_ffsll(~(long long)pos[j]);
+        value[i + j] = (p != 0 && p <= n_ && e[p].key == key[i + j]) ?
+                       e[p].value : miss;
+      }
+    }
+  }
+
+ private:
+  struct Entry {
+    K key;
+    V value;
+  };
+
+  static const size_t kPrefetch = 16;
+
+  // fills the subtree rooted at node k by the sorted pairs in order
+  void Fill(const Entry* sorted, size_t* j, size_t k) {
+    if (k > n_) return;
+    Fill(sorted, j, 2 * k);
+    entries_[k] = sorted[(*j)++];
+    Fill(sorted, j, 2 * k + 1);
+  }
+
+  SArray<Entry> pending_;
+  std::vector<Entry> entries_;
+  size_t n_ = 0;
+  int depth_ = 0;
+  DISALLOW_COPY_AND_ASSIGN(ModelStore);
+};
+
+}  // namespace PS
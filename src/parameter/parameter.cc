@@ -2,6 +2,46 @@
 #include "parameter/parameter.h"
 namespace PS {
 
+DECLARE_int32(num_replicas);
+DEFINE_int32(replica_interval, 1000, "a server ships the pushes it applied to "
+             "its replica nodes at least every this many milliseconds");
+DEFINE_int32(replica_batch, 1000000, "a server ships the pushes it applied to "
+             "its replica nodes once they have this many keys");
+
+int Parameter::PullReplica(const Message::Callback& callback) {
+  Message pull(Request(0, Message::kInvalidTime, {}, Filters(), MyKeyRange()),
+               kReplicaGroup);
+  pull.task.mutable_param()->set_replica(true);
+  pull.callback = callback;
+  return Pull(&pull);
+}
+
+void Parameter::TakeOver(const Node& dead) {
+  if (FLAGS_num_replicas <= 0 || !IsServer()) {
+    Customer::TakeOver(dead);
+    return;
+  }
+  LOG(INFO) << MyNodeID() << " replaces " << dead.id() << ", pulls the replica of "
+            << MyKeyRange();
+  // the callback also runs if no replica node is alive, then the data of the
+  // dead node are lost
+  PullReplica([this]() {
+      VLOG(1) << MyNodeID() << " takes over " << MyKeyRange();
+      HoldRequests(false);
+    });
+}
+
+bool Parameter::LastChunk(const Message* msg) {
+  if (!msg->task.has_chunk()) return true;
+  Lock l(chunk_mu_);
+  auto& chunks = msg->task.request() ? recv_chunks_ : sent_chunks_;
+  auto key = std::make_pair(msg->sender, msg->task.time());
+  int n = ++ chunks[key];
+  if (n < msg->task.chunk().num()) return false;
+  chunks.erase(key);
+  return true;
+}
+
 void Parameter::ProcessRequest(Message* request) {
   const auto& call = request->task.param();
   Message* response = nullptr;
@@ -42,14 +42,49 @@ class Parameter : public Customer {
     return Submit(msg);
   }
 
-  /// @brief Submit a pull message to msg->recver
+  /// @brief Submit a pull message to msg->recver. It is sent after the
+  /// earlier messages to the same node, so it reads the values they pushed,
+  /// unless msg->task.priority() is set larger than theirs
   inline int Pull(Message* msg) {
     msg->task.mutable_param()->set_push(false);
     return Submit(msg);
   }
 
+  /// @brief The same as Push, but returns a future finished with the push
+  inline Future PushAsync(Message* msg) {
+    msg->task.mutable_param()->set_push(true);
+    return SubmitAsync(msg);
+  }
+
+  /// @brief The same as Pull, but returns a future finished with the pull
+  inline Future PullAsync(Message* msg) {
+    msg->task.mutable_param()->set_push(false);
+    return SubmitAsync(msg);
+  }
+
+  /**
+   * @brief Pulls the replica of my key range from the replica group, which is
+   * then loaded by Recover. A server replacing a dead one calls it by TakeOver
+   *
+   * @param callback called once the replica is loaded
+   * @return the timestamp
+   */
+  int PullReplica(const Message::Callback& callback = Message::Callback());
+
+  /// @brief A server replacing a dead one pulls the replica of the dead's key
+  /// range if -num_replicas > 0. The received requests are held until the
+  /// replica is loaded, so they are not applied to the data being replaced
+  virtual void TakeOver(const Node& dead);
+
   virtual void WriteToFile(std::string file) { }
 
+  /// @brief Writes the data into "file" in the binary checkpoint format, see
+  /// parameter/checkpoint.h
+  virtual void SaveCheckpoint(std::string file) { }
+
+  /// @brief Loads the data from a checkpoint written by SaveCheckpoint
+  virtual void LoadCheckpoint(std::string file) { }
+
   virtual void ProcessRequest(Message* request);
   virtual void ProcessResponse(Message* response);
  protected:
@@ -74,6 +109,17 @@ class Parameter : public Customer {
   /// @brief a new server node fill its own datastructure via the the replica data from
   /// the dead's replica node
   virtual void Recover(Message* msg) { }
+
+  /// @brief Returns true if "msg" is not a chunk or it is the last one applied
+  /// of its request (response). The chunks may be processed by several
+  /// executor threads out of order, so it should be called after a chunk is
+  /// applied, see Executor::LastChunk
+  bool LastChunk(const Message* msg);
+
+ private:
+  std::mutex chunk_mu_;
+  // the number of applied chunks, key: <sender, timestamp>
+  std::map<std::pair<NodeID, int>, int> recv_chunks_, sent_chunks_;
 };
 
 }  // namespace PS
@@ -27,6 +27,9 @@ class NodeAssigner {
     kr.To(node->mutable_key());
   }
 
+  // the number of servers given a key range
+  int num_assigned_servers() const { return server_rank_; }
+
   void remove(const Node& node) {
     // TODO
   }
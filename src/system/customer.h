@@ -3,6 +3,7 @@
 #include "system/message.h"
 #include "system/postoffice.h"
 #include "system/executor.h"
+#include "util/future.h"
 
 namespace PS {
 /**
@@ -93,6 +94,27 @@ class Customer {
     return exec_.Submit(request);
   }
 
+  /**
+   * @brief Submits a request message without blocking on its completion
+   *
+   * Sample usage: run Foo() and then Bar() once finished:
+   *   SubmitAsync(&req).Then([this]() { Foo(); }).Then([this]() { Bar(); });
+   *
+   * @param request the same as Submit. request->callback, if any, is called
+   * before the continuations of the returned future
+   *
+   * @return a future which is finished once the request is finished
+   */
+  inline Future SubmitAsync(Message* request) {
+    Promise done;
+    auto callback = request->callback;
+    request->callback = [callback, done]() {
+      if (callback) callback();
+      done.Finish();
+    };
+    return done.future(Submit(request));
+  }
+
   /**
    * @brief Waits until a submitted request is finished
    *
@@ -122,6 +144,50 @@ class Customer {
   virtual void Slice(const Message& request, const std::vector<Range<Key>>& krs,
                      std::vector<Message*>* msgs) { }
 
+  /**
+   * @brief Splits the data of a message into chunks.
+   *
+   * It is called by the executor if -chunk_size is set, for each message
+   * returned by Slice and for each response. The receiver processes the chunks
+   * one by one as they arrive, and the request is finished once all chunks are
+   * processed. Do nothing if the message should not be split.
+   *
+   * @param msg the message
+   * @param max_bytes the maximal data size of a chunk
+   * @param chunks output the chunks, each one is taken from MessagePool with
+   * the task and the receiver of "msg", and Task::chunk set
+   */
+  virtual void Chunk(const Message& msg, size_t max_bytes,
+                     std::vector<Message*>* chunks) { }
+
+  /**
+   * @brief Returns true if "request" can be processed together with other such
+   * requests on the same key channel.
+   *
+   * The executor processes the messages on a key channel one by one, so the
+   * data of a channel need no lock. A customer returns true for the requests
+   * it can process concurrently, such as pushes summed into separate buffers.
+   * They still wait for the other messages on the channel and the messages
+   * from the same sender. It is called before the filters are decoded.
+   */
+  virtual bool Concurrent(const Message& request) { return false; }
+
+  /**
+   * @brief Called once this node replaces the dead node "dead" and takes over
+   * its key range, e.g. to recover the data of the dead node.
+   *
+   * The received requests are held from then on until HoldRequests(false) is
+   * called, e.g. once the data are recovered. It is called by the control
+   * thread, so it should not wait for responses.
+   */
+  virtual void TakeOver(const Node& dead) { HoldRequests(false); }
+
+  /**
+   * @brief Holds the received requests, in order, until called with false. The
+   * responses are still processed.
+   */
+  inline void HoldRequests(bool hold) { exec_.HoldRequests(hold); }
+
   /**
    * @brief A user-defined function, which processes a request message received from "request->sender"
    *
@@ -3,8 +3,27 @@
 #include <thread>
 namespace PS {
 
+DECLARE_int32(num_replicas);
+
+DEFINE_int32(chunk_size, 0, "split the data of a request or a response into "
+             "chunks with at most this many KB, so the receiver can process "
+             "the data while receiving. 0 means disabled");
+DEFINE_int32(num_executor_threads, 1, "number of threads processing the "
+             "received messages of a customer. if > 1, messages with different "
+             "key channels are processed concurrently, and the customer must "
+             "be thread safe across channels");
+DEFINE_int32(num_callback_threads, 0, "number of threads running the "
+             "callbacks of finished requests, so a heavy callback does not "
+             "block the processing of other responses. 0 means running them "
+             "on the executor threads. if > 0, a callback may see a newer "
+             "last response");
+DEFINE_bool(pin_callback, false, "run the callbacks of the requests with the "
+            "same timestamp modulo -num_callback_threads on the same thread "
+            "in order. otherwise any idle callback thread runs the next one");
+
 Executor::Executor(Customer& obj) : obj_(obj), sys_(Postoffice::instance()) {
   my_node_ = Postoffice::instance().manager().van().my_node();
+  num_replicas_ = FLAGS_num_replicas;
   // insert virtual group nodes
   for (auto id : GroupIDs()) {
     Node node;
@@ -13,36 +32,55 @@ Executor::Executor(Customer& obj) : obj_(obj), sys_(Postoffice::instance()) {
     AddNode(node);
   }
 
-  thread_ = new std::thread(&Executor::Run, this);
+  int n = FLAGS_num_callback_threads;
+  if (n > 0) {
+    // unpinned threads share a single queue
+    int num_queues = FLAGS_pin_callback ? n : 1;
+    for (int i = 0; i < num_queues; ++i) {
+      callback_queues_.push_back(std::unique_ptr<ThreadsafeQueue<CallbackTask>>(
+          new ThreadsafeQueue<CallbackTask>()));
+    }
+    for (int i = 0; i < n; ++i) {
+      callback_threads_.push_back(
+          std::thread(&Executor::RunCallbackThread, this, i % num_queues));
+    }
+  }
+
+  for (int i = 0; i < std::max(FLAGS_num_executor_threads, 1); ++i) {
+    threads_.push_back(std::thread(&Executor::Run, this));
+  }
 }
 
 Executor::~Executor() {
   if (done_) return;
   done_ = true;
 
-  // wake thread_
+  // wake threads_
   { Lock l(msg_mu_); }
   dag_cond_.notify_all();
 
-  CHECK_NOTNULL(thread_)->join();
-  delete thread_;
+  for (auto& t : threads_) t.join();
+
+  // stop the callback threads after running the queued callbacks
+  for (size_t i = 0; i < callback_threads_.size(); ++i) {
+    callback_queues_[i % callback_queues_.size()]->push(CallbackTask());
+  }
+  for (auto& t : callback_threads_) t.join();
 }
 
 bool Executor::CheckFinished(RemoteNode* rnode, int timestamp, bool sent) {
   CHECK(rnode);
   if (timestamp < 0) return true;
-  auto& tracker = sent ? rnode->sent_req_tracker : rnode->recv_req_tracker;
-  if (!rnode->alive || tracker.IsFinished(timestamp)) return true;
+  if (!rnode->alive) return true;
   if (rnode->node.role() == Node::GROUP) {
     for (auto r : rnode->group) {
       auto& r_tracker = sent ? r->sent_req_tracker : r->recv_req_tracker;
       if (r->alive && !r_tracker.IsFinished(timestamp)) return false;
-      // well, set this group node as been finished
-      r_tracker.Finish(timestamp);
     }
     return true;
   }
-  return false;
+  auto& tracker = sent ? rnode->sent_req_tracker : rnode->recv_req_tracker;
+  return tracker.IsFinished(timestamp);
 }
 int Executor::NumFinished(RemoteNode* rnode, int timestamp, bool sent) {
   CHECK(rnode);
@@ -67,7 +105,8 @@ void Executor::WaitSentReq(int timestamp) {
   CHECK(recver.size());
   auto rnode = GetRNode(recver);
   sent_req_cond_.wait(lk, [this, rnode, timestamp] {
-      return CheckFinished(rnode, timestamp, true);
+      return CheckFinished(rnode, timestamp, true) &&
+          pending_callbacks_.count(timestamp) == 0;
     });
 }
 
@@ -91,23 +130,33 @@ void Executor::FinishRecvReq(int timestamp, const NodeID& sender) {
   VLOG(1) << obj_.id() << ": finish request "
           << timestamp << " from " << sender;
   auto rnode = GetRNode(sender);
-  rnode->recv_req_tracker.Finish(timestamp);
   if (rnode->node.role() == Node::GROUP) {
     for (auto r : rnode->group) {
       r->recv_req_tracker.Finish(timestamp);
     }
+  } else {
+    rnode->recv_req_tracker.Finish(timestamp);
   }
   lk.unlock();
   recv_req_cond_.notify_all();
 
-  { Lock lk(msg_mu_); }
+  {
+    // move the messages waiting for it into the ready queue
+    Lock l(msg_mu_);
+    Lock l2(node_mu_);
+    if (rnode->node.role() == Node::GROUP) {
+      for (auto r : rnode->group) Wake(r->node.id(), timestamp);
+    } else {
+      Wake(sender, timestamp);
+    }
+  }
   dag_cond_.notify_all();
 }
 
 
 int Executor::Submit(Message* msg) {
   CHECK(msg); CHECK(msg->recver.size());
-  Lock l(node_mu_);
+  std::unique_lock<std::mutex> lk(node_mu_);
 
   // timestamp and other flags
   int ts = msg->task.has_time() ? msg->task.time() : time_ + 1;
@@ -127,26 +176,83 @@ int Executor::Submit(Message* msg) {
   // slice "msg"
   RemoteNode* rnode = GetRNode(msg->recver);
   std::vector<Message*> msgs(rnode->keys.size());
-  for (auto& m : msgs) m = new Message(msg->task);
+  for (auto& m : msgs) {
+    // a recycled task reuses its memory when copying
+    m = MessagePool::instance().Get();
+    m->task.CopyFrom(msg->task);
+  }
   obj_.Slice(*msg, rnode->keys, &msgs);
   CHECK_EQ(msgs.size(), rnode->group.size());
 
   // send them one by one
+  int num_sent = 0;
   for (int i = 0; i < msgs.size(); ++i) {
     RemoteNode* r = CHECK_NOTNULL(rnode->group[i]);
     Message* m = CHECK_NOTNULL(msgs[i]);
     if (!m->valid) {
       // do not sent, just mark it as done
       r->sent_req_tracker.Finish(ts);
+      r->SkipRequest(ts);
+      MessagePool::instance().Put(m);
       continue;
     }
-    r->EncodeMessage(m);
     m->recver = r->node.id();
-    sys_.Queue(m);
+    for (const auto& s : r->skipped_reqs) s.To(m->task.add_skipped_time());
+    r->skipped_reqs.clear();
+    Queue(r, m);
+    ++ num_sent;
+  }
+
+  // the other nodes never receive this timestamp
+  std::unordered_set<RemoteNode*> recvers(
+      rnode->group.begin(), rnode->group.end());
+  for (auto& it : nodes_) {
+    RemoteNode* r = &it.second;
+    if (r->node.role() == Node::GROUP || recvers.count(r)) continue;
+    r->sent_req_tracker.Finish(ts);
+    r->SkipRequest(ts);
+  }
+
+  if (num_sent == 0) {
+    // no response will come, so the request is finished now
+    Message::Callback callback;
+    callback.swap(req_info.callback);
+    bool async = callback && !callback_threads_.empty();
+    if (async) pending_callbacks_.insert(ts);
+    lk.unlock();
+    if (callback) RunCallback(ts, std::move(callback));
+    if (!async) sent_req_cond_.notify_all();
   }
   return ts;
 }
 
+void Executor::Queue(RemoteNode* rnode, Message* msg) {
+  std::vector<Message*> chunks;
+  if (FLAGS_chunk_size > 0 && msg->has_data() && !msg->task.has_chunk()) {
+    obj_.Chunk(*msg, (size_t)FLAGS_chunk_size << 10, &chunks);
+  }
+  if (chunks.empty()) {
+    chunks.push_back(msg);
+  } else {
+    MessagePool::instance().Put(msg);
+  }
+  for (auto m : chunks) {
+    rnode->EncodeMessage(m);
+    sys_.Queue(m);
+  }
+}
+
+bool Executor::LastChunk(Message* msg) {
+  if (!msg->task.has_chunk()) return true;
+  Lock l(node_mu_);
+  auto& chunks = msg->task.request() ? recv_chunks_ : sent_chunks_;
+  auto key = std::make_pair(msg->sender, msg->task.time());
+  int n = ++ chunks[key];
+  if (n < msg->task.chunk().num()) return false;
+  chunks.erase(key);
+  return true;
+}
+
 void Executor::Reply(Message* request, Message* response) {
   const auto& req = CHECK_NOTNULL(request)->task;
   if (!req.request()) return;
@@ -156,23 +262,44 @@ void Executor::Reply(Message* request, Message* response) {
   if (req.has_control()) res.set_control(req.control());
   if (req.has_customer_id()) res.set_customer_id(req.customer_id());
   res.set_time(req.time());
+  // the requester waits for it
+  if (req.has_priority() && !res.has_priority()) res.set_priority(req.priority());
+  // one response per chunk
+  if (req.has_chunk()) res.mutable_chunk()->CopyFrom(req.chunk());
 
   response->recver = request->sender;
   node_mu_.lock();
-  GetRNode(response->recver)->EncodeMessage(response);
+  Queue(GetRNode(response->recver), response);
   node_mu_.unlock();
-  sys_.Queue(response);
 
   request->replied = true;
 }
 
-bool Executor::PickActiveMsg() {
+std::shared_ptr<Message> Executor::PickActiveMsg() {
   std::unique_lock<std::mutex> lk(msg_mu_);
   // VLOG(1) << obj_.id() << ": try to pick a message";
-  auto it = recv_msgs_.begin();
-  while (it != recv_msgs_.end()) {
-    bool process = true;
+  // the senders skipped in this pass, their later messages must wait too
+  std::unordered_set<NodeID> skipped;
+  // the channels a non-concurrent message is waiting for, later concurrent
+  // messages must wait too, otherwise they could keep it waiting forever
+  std::unordered_set<int> waiting;
+  auto it = ready_msgs_.begin();
+  while (it != ready_msgs_.end()) {
     Message* msg = *it; CHECK(msg); CHECK(!msg->task.control());
+    if (hold_requests_ && msg->task.request()) { ++ it; continue; }
+    int chl = msg->task.key_channel();
+    auto busy = busy_channels_.find(chl);
+    bool concurrent = msg->task.request() && obj_.Concurrent(*msg);
+    if (busy_senders_.count(msg->sender) || skipped.count(msg->sender) ||
+        (busy != busy_channels_.end() && (busy->second < 0 || !concurrent)) ||
+        (concurrent && waiting.count(chl))) {
+      // being processed by another thread
+      skipped.insert(msg->sender);
+      if (!concurrent && busy != busy_channels_.end()) waiting.insert(chl);
+      ++ it;
+      continue;
+    }
+    it = ready_msgs_.erase(it);
 
     // check if the remote node is still alive.
     Lock l(node_mu_);
@@ -180,8 +307,7 @@ bool Executor::PickActiveMsg() {
     if (!rnode->alive) {
       LOG(WARNING) << my_node_.id() << ": rnode " << msg->sender <<
           " is not alive, ignore received message: " << msg->ShortDebugString();
-      it = recv_msgs_.erase(it);
-      delete msg;
+      MessagePool::instance().Put(msg);
       continue;
     }
     // check if double receiving
@@ -191,74 +317,125 @@ bool Executor::PickActiveMsg() {
         (!req && rnode->sent_req_tracker.IsFinished(ts))) {
       LOG(WARNING) << my_node_.id() << ": received message twice. ignore: " <<
           msg->ShortDebugString();
-      it = recv_msgs_.erase(it);
-      delete msg;
+      MessagePool::instance().Put(msg);
       continue;
     }
 
-    // check for dependency constraint. only needed for request message.
-    if (req) {
-      for (int i = 0; i < msg->task.wait_time_size(); ++i) {
-        int wait_time = msg->task.wait_time(i);
-        if (wait_time <= Message::kInvalidTime) continue;
-        if (!rnode->recv_req_tracker.IsFinished(wait_time)) {
-          process = false;
-          ++ it;
-          break;
-        }
-      }
+    VLOG(1) << obj_.id() << ": pick a messge in ["
+            << ready_msgs_.size() + 1 << "] ready ones from " << msg->sender
+            << ": " << msg->ShortDebugString();
+
+    busy_senders_.insert(msg->sender);
+    if (concurrent) {
+      ++ busy_channels_[chl];
+    } else {
+      busy_channels_[chl] = -1;
     }
-    if (process) {
-      VLOG(1) << obj_.id() << ": pick the "
-              << std::distance(recv_msgs_.begin(), it) << "-th messge in ["
-              << recv_msgs_.size() << "] from " << msg->sender
-              << ": " << msg->ShortDebugString();
-
-      active_msg_ = std::shared_ptr<Message>(msg);
-      recv_msgs_.erase(it);
-      rnode->DecodeMessage(active_msg_.get());
-      return true;
+    if (req) {
+      last_request_ = std::shared_ptr<Message>(msg, [](Message* m) {
+          MessagePool::instance().Put(m);
+        });
+    } else {
+      last_response_ = std::shared_ptr<Message>(msg, [](Message* m) {
+          MessagePool::instance().Put(m);
+        });
     }
+    rnode->DecodeMessage(msg);
+    return req ? last_request_ : last_response_;
   }
 
-  // sleep until received a new message or another message been marked as
-  // finished.
-  VLOG(1) << obj_.id() << ": pick nothing. msg buffer size "
-          << recv_msgs_.size();
+  // sleep until received a new message, another message been marked as
+  // finished, or a message been processed.
+  VLOG(1) << obj_.id() << ": pick nothing. " << num_blocked_
+          << " messages are blocked";
   dag_cond_.wait(lk);
-  return false;
+  return std::shared_ptr<Message>();
 }
 
-void Executor::ProcessActiveMsg() {
+void Executor::HoldRequests(bool hold) {
+  {
+    Lock l(msg_mu_);
+    hold_requests_ = hold;
+  }
+  if (!hold) dag_cond_.notify_all();
+}
+
+void Executor::FinishActiveMsg(const NodeID& sender, int channel) {
+  {
+    Lock l(msg_mu_);
+    busy_senders_.erase(sender);
+    auto it = busy_channels_.find(channel);
+    if (it != busy_channels_.end() && (it->second < 0 || -- it->second == 0)) {
+      busy_channels_.erase(it);
+    }
+  }
+  if (threads_.size() > 1) dag_cond_.notify_all();
+}
+
+int Executor::UnfinishedWaitTime(Message* msg) {
+  if (!msg->task.request()) return Message::kInvalidTime;
+  auto it = nodes_.find(msg->sender);
+  // leave it to PickActiveMsg
+  if (it == nodes_.end() || !it->second.alive) return Message::kInvalidTime;
+  auto& tracker = it->second.recv_req_tracker;
+  for (int i = 0; i < msg->task.wait_time_size(); ++i) {
+    int wait_time = msg->task.wait_time(i);
+    if (wait_time <= Message::kInvalidTime) continue;
+    if (!tracker.IsFinished(wait_time)) return wait_time;
+  }
+  return Message::kInvalidTime;
+}
+
+void Executor::Schedule(Message* msg) {
+  int wait_time = UnfinishedWaitTime(msg);
+  if (wait_time == Message::kInvalidTime) {
+    ready_msgs_.push_back(msg);
+  } else {
+    blocked_msgs_[std::make_pair(msg->sender, wait_time)].push_back(msg);
+    ++ num_blocked_;
+  }
+}
+
+void Executor::Wake(const NodeID& sender, int timestamp) {
+  auto it = blocked_msgs_.find(std::make_pair(sender, timestamp));
+  if (it == blocked_msgs_.end()) return;
+  std::vector<Message*> msgs;
+  msgs.swap(it->second);
+  blocked_msgs_.erase(it);
+  num_blocked_ -= msgs.size();
+  // they may still wait for other timestamps
+  for (auto msg : msgs) Schedule(msg);
+}
+
+void Executor::ProcessActiveMsg(Message* msg) {
   // ask the customer to process the picked message, and do post-processing
-  bool req = active_msg_->task.request();
-  int ts = active_msg_->task.time();
+  bool req = msg->task.request();
+  int ts = msg->task.time();
   if (req) {
-    last_request_ = active_msg_;
-    obj_.ProcessRequest(active_msg_.get());
+    obj_.ProcessRequest(msg);
 
-    if (active_msg_->finished) {
+    if (msg->finished) {
       // if this message is marked as finished, then set the mark in tracker,
       // otherwise, the user application need to call `Customer::FinishRecvReq`
-      // to set the mark
-      FinishRecvReq(ts, active_msg_->sender);
+      // to set the mark. a chunked request is finished with its last chunk
+      if (LastChunk(msg)) FinishRecvReq(ts, msg->sender);
       // reply an empty ACK message if necessary
-      if (!active_msg_->replied) obj_.Reply(active_msg_.get());
+      if (!msg->replied) obj_.Reply(msg);
     }
   } else {
-    last_response_ = active_msg_;
-    obj_.ProcessResponse(active_msg_.get());
+    obj_.ProcessResponse(msg);
+    if (!LastChunk(msg)) return;
 
     std::unique_lock<std::mutex> lk(node_mu_);
     // mark as finished
-    auto rnode = GetRNode(active_msg_->sender);
+    auto rnode = GetRNode(msg->sender);
     rnode->sent_req_tracker.Finish(ts);
 
     // check if the callback is ready to run
     auto it = sent_reqs_.find(ts);
     CHECK(it != sent_reqs_.end());
     const NodeID& orig_recver = it->second.recver;
-    if (orig_recver != active_msg_->sender) {
+    if (orig_recver != msg->sender) {
       auto onode = GetRNode(orig_recver);
       if (onode->node.role() == Node::GROUP) {
         // the orginal recver is a group node, need to check whether repsonses
@@ -268,40 +445,103 @@ void Executor::ProcessActiveMsg() {
             return;
           }
         }
-        onode->sent_req_tracker.Finish(ts);
       } else {
-        // the orig_recver should be dead, and active_msgs_->sender is the
+        // the orig_recver should be dead, and msg->sender is the
         // replacement of this dead node. Just run callback
       }
     }
+    // take the callback, "it" may be invalid once unlocked
+    Message::Callback callback;
+    callback.swap(it->second.callback);
+    bool async = callback && !callback_threads_.empty();
+    if (async) pending_callbacks_.insert(ts);
     lk.unlock();
 
-    if (it->second.callback) {
-      // run the callback, and then empty it
-      it->second.callback();
-      it->second.callback = Message::Callback();
-    }
+    // run the callback
+    if (callback) RunCallback(ts, std::move(callback));
+
+    // if async, the request is waited until the callback is finished
+    if (!async) sent_req_cond_.notify_all();
+  }
+}
 
+void Executor::RunCallback(int timestamp, Message::Callback&& callback) {
+  if (callback_threads_.empty()) {
+    callback();
+    return;
+  }
+  CallbackTask task;
+  task.time = timestamp;
+  task.callback = std::move(callback);
+  callback_queues_[timestamp % callback_queues_.size()]->push(std::move(task));
+}
+
+void Executor::RunCallbackThread(int i) {
+  auto& queue = *callback_queues_[i];
+  while (true) {
+    CallbackTask task;
+    queue.wait_and_pop(task);
+    if (!task.callback) break;
+    task.callback();
+    {
+      Lock l(node_mu_);
+      pending_callbacks_.erase(task.time);
+    }
     sent_req_cond_.notify_all();
   }
 }
 
 void Executor::Accept(Message* msg) {
+  bool skipped = msg->task.request() && msg->task.skipped_time_size() > 0;
   {
     Lock l(msg_mu_);
-    recv_msgs_.push_back(msg);
+    Lock l2(node_mu_);
+    if (skipped) {
+      // the requests which the sender never sent to me
+      auto it = nodes_.find(msg->sender);
+      if (it != nodes_.end()) {
+        for (const auto& pb : msg->task.skipped_time()) {
+          Range<int> r(pb);
+          for (int ts = r.begin(); ts < r.end(); ++ts) {
+            it->second.recv_req_tracker.Finish(ts);
+            Wake(msg->sender, ts);
+          }
+        }
+      }
+      msg->task.clear_skipped_time();
+    }
+    Schedule(msg);
     // VLOG(1) << obj_.id() << ": accept " << msg->ShortDebugString();
   }
-  dag_cond_.notify_one();
+  if (skipped) {
+    recv_req_cond_.notify_all();
+    dag_cond_.notify_all();
+  } else {
+    dag_cond_.notify_one();
+  }
 }
 
 
 void Executor::ReplaceNode(const Node& old_node, const Node& new_node) {
-  // TODO
+  VLOG(1) << obj_.id() << "replace node: " << old_node.ShortDebugString()
+          << " by " << new_node.ShortDebugString();
+  // the new node takes over the key range of the old one
+  Node node = new_node;
+  if (old_node.has_key()) *node.mutable_key() = old_node.key();
+  RemoveNode(old_node);
+  AddNode(node);
+  // recover the data after the replica group is updated by AddNode. the
+  // requests wait for it, the customer releases them
+  if (node.id() == my_node_.id()) {
+    HoldRequests(true);
+    obj_.TakeOver(old_node);
+  }
 }
 
 void Executor::RemoveNode(const Node& node) {
   VLOG(1) << obj_.id() << "remove node: " << node.ShortDebugString();
+  Lock l(msg_mu_);
+  Lock l2(node_mu_);
   auto id = node.id();
   if (nodes_.find(id) == nodes_.end()) return;
   auto r = GetRNode(id);
@@ -310,6 +550,15 @@ void Executor::RemoveNode(const Node& node) {
   }
   // do not remove r from nodes_
   r->alive = false;
+
+  // drop the blocked messages from this node. the ready ones will be dropped
+  // by PickActiveMsg
+  auto it = blocked_msgs_.lower_bound(std::make_pair(id, INT_MIN));
+  while (it != blocked_msgs_.end() && it->first.first == id) {
+    for (auto msg : it->second) MessagePool::instance().Put(msg);
+    num_blocked_ -= it->second.size();
+    it = blocked_msgs_.erase(it);
+  }
 }
 
 void Executor::AddNode(const Node& node) {
@@ -330,7 +579,13 @@ void Executor::AddNode(const Node& node) {
     }
   } else {
     // create
-    nodes_[id].node = node;
+    auto& r = nodes_[id];
+    r.node = node;
+    // it has not received any of the timestamps submitted before
+    if (node.role() != Node::GROUP && time_ >= 0) {
+      r.sent_req_tracker.FinishBelow(time_ + 1);
+      r.skipped_reqs.push_back(Range<int>(0, time_ + 1));
+    }
   }
 
   // add "node" into group
@@ -351,22 +606,24 @@ void Executor::AddNode(const Node& node) {
   if (num_replicas_ <= 0) return;
 
   const auto& servers = nodes_[kServerGroup];
-  for (int i = 0; i < servers.group.size(); ++i) {
+  int n = servers.group.size();
+  int r = std::min(num_replicas_, n - 1);
+  for (int i = 0; i < n; ++i) {
     auto s = servers.group[i];
     if (s->node.id() != my_node_.id()) continue;
 
-    // the replica group is just before me
+    // the replica group, which keeps my replicas, is just before me, and the
+    // owner group, whose replicas are kept by me, is just after me. both wrap
+    // around
     auto& replicas = nodes_[kReplicaGroup];
+    auto& owners = nodes_[kOwnerGroup];
     replicas.group.clear(); replicas.keys.clear();
-    for (int j = std::max(i-num_replicas_, 0); j < i; ++ j) {
+    owners.group.clear(); owners.keys.clear();
+    for (int d = 1; d <= r; ++d) {
+      int j = (i - d + n) % n;
       replicas.group.push_back(servers.group[j]);
       replicas.keys.push_back(servers.keys[j]);
-    }
-
-    // the owner group is just after me
-    auto& owners = nodes_[kOwnerGroup];
-    owners.group.clear(); owners.keys.clear();
-    for (int j = std::max(i-num_replicas_, 0); j < i; ++ j) {
+      j = (i + d) % n;
       owners.group.push_back(servers.group[j]);
       owners.keys.push_back(servers.keys[j]);
     }
@@ -1,6 +1,7 @@
 #pragma once
 #include "system/remote_node.h"
 #include "system/message.h"
+#include "util/threadsafe_queue.h"
 namespace PS {
 
 const static NodeID kGroupPrefix  = "all_";
@@ -34,11 +35,19 @@ class Executor {
   void WaitRecvReq(int timestamp, const NodeID& sender);
   void FinishRecvReq(int timestamp, const NodeID& sender);
   int QueryRecvReq(int timestamp, const NodeID& sender);
-
-  // the last received request
-  inline std::shared_ptr<Message> last_request() { return last_request_; }
+  // holds the received requests, in order, until called with false. the
+  // responses are still processed
+  void HoldRequests(bool hold);
+
+  // the last received request. if there are multiple processing threads, it is
+  // the one picked most recently by any thread
+  inline std::shared_ptr<Message> last_request() {
+    Lock l(msg_mu_); return last_request_;
+  }
   // the last received response
-  inline std::shared_ptr<Message> last_response() { return last_response_; }
+  inline std::shared_ptr<Message> last_response() {
+    Lock l(msg_mu_); return last_response_;
+  }
 
   int time() { Lock l(node_mu_); return time_; }
   // node management
@@ -46,22 +55,77 @@ class Executor {
   void RemoveNode(const Node& node);
   void ReplaceNode(const Node& old_node, const Node& new_node);
  private:
-  // Runs the DAG engine
+  // Runs the DAG engine. There are -num_executor_threads threads running it
   void Run() {
     while (!done_) {
-      if (PickActiveMsg()) ProcessActiveMsg();
+      auto msg = PickActiveMsg();
+      if (!msg) continue;
+      NodeID sender = msg->sender;
+      int chl = msg->task.key_channel();
+      ProcessActiveMsg(msg.get());
+      FinishActiveMsg(sender, chl);
     }
   }
-  // Returns true if a message with dependency satisfied is picked. Otherwise
-  // will be blocked.
-  bool PickActiveMsg();
-  void ProcessActiveMsg();
+  // Returns a message with dependency satisfied, and no message from the same
+  // sender or on the same key channel is being processed, except the ones
+  // which are all Customer::Concurrent. Otherwise will be blocked and returns
+  // nullptr.
+  std::shared_ptr<Message> PickActiveMsg();
+  void ProcessActiveMsg(Message* msg);
+  // marks the message from "sender" on "channel" as processed
+  void FinishActiveMsg(const NodeID& sender, int channel);
+
+  // runs "callback" of the request "timestamp" on the callback threads if
+  // there are any, otherwise runs it directly
+  void RunCallback(int timestamp, Message::Callback&& callback);
+  // the callback threads, each of them pops callbacks from a queue
+  void RunCallbackThread(int i);
+  struct CallbackTask {
+    int time;
+    Message::Callback callback;
+  };
+  // a stop signal if callback is empty
+  std::vector<std::unique_ptr<ThreadsafeQueue<CallbackTask>>> callback_queues_;
+  std::vector<std::thread> callback_threads_;
+  // the timestamps whose callbacks are queued or running. guarded by node_mu_
+  std::unordered_set<int> pending_callbacks_;
+
+  // splits "msg" into chunks if necessary, then encodes and sends them to
+  // "rnode". must hold node_mu_
+  void Queue(RemoteNode* rnode, Message* msg);
+  // returns true if "msg" is not a chunk or it is the last one received of its
+  // request (response)
+  bool LastChunk(Message* msg);
+  // the number of received chunks, key: <sender, timestamp>
+  std::map<std::pair<NodeID, int>, int> recv_chunks_, sent_chunks_;
 
   // -- received messages --
-  std::list<Message*> recv_msgs_;
+  // puts "msg" into the ready queue if its dependencies are satisfied,
+  // otherwise indexes it by the first unfinished timestamp it waits for. must
+  // hold both msg_mu_ and node_mu_
+  void Schedule(Message* msg);
+  // reschedules the messages waiting for the request "timestamp" from
+  // "sender". must hold both msg_mu_ and node_mu_
+  void Wake(const NodeID& sender, int timestamp);
+  // returns the first timestamp "msg" waits for but not finished yet, or
+  // Message::kInvalidTime. must hold node_mu_
+  int UnfinishedWaitTime(Message* msg);
+  // messages can be processed now, in the order of becoming ready
+  std::list<Message*> ready_msgs_;
+  // blocked messages, key: <sender, the timestamp waiting for>
+  std::map<std::pair<NodeID, int>, std::vector<Message*>> blocked_msgs_;
+  size_t num_blocked_ = 0;
+  // lock order: msg_mu_ then node_mu_
   std::mutex msg_mu_;
-  // the message is going to be processed or the last one be processed
-  std::shared_ptr<Message> active_msg_, last_request_, last_response_;
+  // the last picked ones
+  std::shared_ptr<Message> last_request_, last_response_;
+  // the senders of the messages being processed
+  std::unordered_set<NodeID> busy_senders_;
+  // <key channel, the number of concurrent messages being processed>, or -1
+  // if a non-concurrent one is being processed
+  std::unordered_map<int, int> busy_channels_;
+  // see HoldRequests
+  bool hold_requests_ = false;
   std::condition_variable dag_cond_;
 
   // -- remote nodes --
@@ -98,9 +162,9 @@ class Executor {
   // <timestamp, (receiver, callback)>
   std::unordered_map<int, ReqInfo> sent_reqs_;
 
-  // the processing thread
+  // the processing threads
   bool done_ = false;
-  std::thread* thread_ = nullptr;
+  std::vector<std::thread> threads_;
 };
 
 } // namespace PS
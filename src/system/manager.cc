@@ -54,8 +54,12 @@ void Manager::Run() {
   // while run() is called by the main thread, so here should be a thread
   // synchronization.
 
-  // wait my node info is updated
-  while (!is_my_node_inited_) usleep(500);
+  // wait my node info is updated. a spare server waits until it replaces a
+  // dead one, or the system stops
+  while (!is_my_node_inited_) {
+    if (done_) return;
+    usleep(500);
+  }
   if (van_.my_node().role() == Node::WORKER) {
     WaitServersReady();
   }
@@ -73,9 +77,17 @@ void Manager::Stop() {
       Task task = NewControlTask(Control::EXIT);
       SendTask(it.second, task);
     }
+    {
+      Lock l(nodes_mu_);
+      for (const auto& node : spare_servers_) {
+        SendTask(node, NewControlTask(Control::EXIT));
+      }
+    }
     usleep(800);
     LOG(INFO) << "System stopped";
   } else {
+    // a spare server is stopped by the scheduler
+    if (done_) return;
     Task task = NewControlTask(Control::READY_TO_EXIT);
     SendTask(van_.scheduler(), task);
 
@@ -111,7 +123,14 @@ bool Manager::Process(Message* msg) {
         CHECK(IsScheduler());
         CHECK_EQ(ctrl.node_size(), 1);
         Node sender = ctrl.node(0);
-        CHECK_NOTNULL(node_assigner_)->assign(&sender);
+        CHECK_NOTNULL(node_assigner_);
+        if (sender.role() == Node::SERVER && FLAGS_num_replicas > 0 &&
+            node_assigner_->num_assigned_servers() >= FLAGS_num_servers) {
+          // all key ranges are assigned
+          AddSpareServer(sender);
+          break;
+        }
+        node_assigner_->assign(&sender);
         AddNode(sender);
         break;
       }
@@ -132,7 +151,17 @@ bool Manager::Process(Message* msg) {
         } break;
       }
       case Control::REPLACE_NODE: {
-        // TODO
+        // node(0) is the dead node, and node(1) replaces it. the new node also
+        // gets the others, and holds the requests from them until its
+        // customers take over, see Executor::ReplaceNode
+        CHECK_GE(ctrl.node_size(), 2);
+        if (ctrl.node(1).id() == van_.my_node().id()) {
+          for (auto& it : customers_) {
+            it.second.first->executor()->HoldRequests(true);
+          }
+        }
+        for (int i = 2; i < ctrl.node_size(); ++i) AddNode(ctrl.node(i));
+        ReplaceNode(ctrl.node(0), ctrl.node(1));
         break;
       }
       case Control::REMOVE_NODE: {
@@ -207,7 +236,10 @@ void Manager::AddNode(const Node& node) {
 void Manager::RemoveNode(const NodeID& node_id) {
   nodes_mu_.lock();
   auto it = nodes_.find(node_id);
-  if (it == nodes_.end()) return;
+  if (it == nodes_.end()) {
+    nodes_mu_.unlock();
+    return;
+  }
   Node node = it->second;
   // van_.disconnect(node);
   if (node.role() == Node::WORKER) -- num_workers_;
@@ -243,6 +275,58 @@ void Manager::RemoveNode(const NodeID& node_id) {
   VLOG(1) << "remove node: " << node.ShortDebugString();
 }
 
+void Manager::ReplaceNode(const Node& old_node, const Node& new_node) {
+  // the new node takes over the key range of the old one
+  Node node = new_node;
+  if (old_node.has_key()) *node.mutable_key() = old_node.key();
+
+  nodes_mu_.lock();
+  auto it = nodes_.find(old_node.id());
+  if (it != nodes_.end()) {
+    if (it->second.role() == Node::WORKER) -- num_workers_;
+    if (it->second.role() == Node::SERVER) -- num_servers_;
+    -- num_active_nodes_;
+    nodes_.erase(it);
+  }
+  if (nodes_.find(node.id()) == nodes_.end()) {
+    // as AddNode, a new node also connects to itself
+    if (!IsScheduler()) CHECK(van_.Connect(node));
+    if (node.role() == Node::WORKER) ++ num_workers_;
+    if (node.role() == Node::SERVER) ++ num_servers_;
+    ++ num_active_nodes_;
+  }
+  nodes_[node.id()] = node;
+  nodes_mu_.unlock();
+  // MyKeyRange() is read from the van
+  if (node.id() == van_.my_node().id()) van_.my_node() = node;
+
+  // the customers of the new node recover the data of the old one
+  for (auto& it : customers_) {
+    it.second.first->executor()->ReplaceNode(old_node, node);
+  }
+
+  // broadcast, to the new node first, which does not know the others yet
+  if (IsScheduler()) {
+    Task replace = NewControlTask(Control::REPLACE_NODE);
+    *replace.mutable_ctrl()->add_node() = old_node;
+    *replace.mutable_ctrl()->add_node() = node;
+    for (const auto& it : nodes_) {
+      if (it.first != node.id()) *replace.mutable_ctrl()->add_node() = it.second;
+    }
+    SendTask(node, replace);
+    for (const auto& it : nodes_) {
+      if (it.first == van_.my_node().id() || it.first == node.id()) continue;
+      Task replace = NewControlTask(Control::REPLACE_NODE);
+      *replace.mutable_ctrl()->add_node() = old_node;
+      *replace.mutable_ctrl()->add_node() = node;
+      SendTask(it.second, replace);
+    }
+  }
+  if (node.id() == van_.my_node().id()) is_my_node_inited_ = true;
+  VLOG(1) << "replace node: " << old_node.ShortDebugString() << " by "
+          << node.ShortDebugString();
+}
+
 void Manager::NodeDisconnected(const NodeID node_id) {
   // alreay in shutting down?
   if (in_exit_) return;
@@ -252,7 +336,36 @@ void Manager::NodeDisconnected(const NodeID node_id) {
 
   if (IsScheduler()) {
     LOG(INFO) << node_id << " is disconnected";
+    Node dead;
+    {
+      Lock l(nodes_mu_);
+      for (auto it = spare_servers_.begin(); it != spare_servers_.end(); ++it) {
+        if (it->id() == node_id) {
+          spare_servers_.erase(it);
+          return;
+        }
+      }
+      auto it = nodes_.find(node_id);
+      if (it == nodes_.end()) return;
+      dead = it->second;
+    }
     RemoveNode(node_id);
+    if (dead.role() != Node::SERVER || FLAGS_num_replicas <= 0) return;
+
+    // a spare server, or the next server registering, takes over the key
+    // range of the dead one from its replicas
+    Node spare;
+    {
+      Lock l(nodes_mu_);
+      if (spare_servers_.empty()) {
+        LOG(INFO) << "waiting for a server to replace " << node_id;
+        dead_servers_.push_back(dead);
+        return;
+      }
+      spare = spare_servers_.front();
+      spare_servers_.pop_front();
+    }
+    ReplaceNode(dead, spare);
   } else {
     // sleep a while, in case this node is already in terminating
     for (int i = 0; i < 1000; ++i) {
@@ -265,6 +378,22 @@ void Manager::NodeDisconnected(const NodeID node_id) {
   }
 }
 
+void Manager::AddSpareServer(const Node& node) {
+  CHECK(IsScheduler());
+  Node dead;
+  {
+    Lock l(nodes_mu_);
+    if (dead_servers_.empty()) {
+      LOG(INFO) << node.id() << " is a spare server";
+      spare_servers_.push_back(node);
+      return;
+    }
+    dead = dead_servers_.front();
+    dead_servers_.pop_front();
+  }
+  ReplaceNode(dead, node);
+}
+
 Task Manager::NewControlTask(Control::Command cmd) {
   Task task;
   task.set_control(true);
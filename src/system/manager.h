@@ -23,8 +23,12 @@ class Manager {
   // manage nodes
   void AddNode(const Node& node);
   void RemoveNode(const NodeID& node_id);
+  void ReplaceNode(const Node& old_node, const Node& new_node);
   // detect that *node_id* is disconnected
   void NodeDisconnected(const NodeID node_id);
+  // a server registering after all key ranges are assigned, it replaces the
+  // next dead server. only used by the scheduler if -num_replicas > 0
+  void AddSpareServer(const Node& node);
   // add a function handler which will be called in *nodeDisconnected*
   typedef std::function<void(const NodeID&)> NodeFailureHandler;
   void AddNodeFailureHandler(NodeFailureHandler handler) {
@@ -45,7 +49,7 @@ class Manager {
   int num_servers() { return num_servers_; }
 
   // manage message TODO
-  void AddRequest(Message* msg) { delete msg; }
+  void AddRequest(Message* msg) { MessagePool::instance().Put(msg); }
   void AddResponse(Message* msg) { }
 
   // accessors
@@ -77,6 +81,10 @@ class Manager {
 
   // only available at the scheduler node
   NodeAssigner* node_assigner_ = nullptr;
+  // the servers waiting for a dead one to replace, and the dead servers
+  // waiting for a replacement. guarded by nodes_mu_
+  std::list<Node> spare_servers_;
+  std::list<Node> dead_servers_;
 
   // customers
   // format: <id, <obj_ptr, is_deletable>>
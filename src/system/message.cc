@@ -13,6 +13,48 @@ FilterConfig* Message::add_filter(FilterConfig::Type type) {
   return ptr;
 }
 
+void ChunkDenseMessage(
+    const Message& msg, size_t max_bytes, std::vector<Message*>* chunks) {
+  Range<Key> kr(msg.task.key_range());
+  if (msg.value.empty() || kr.empty()) return;
+  size_t bytes_per_key = 0;
+  for (const auto& v : msg.value) {
+    CHECK_EQ(v.size() % kr.size(), 0);
+    bytes_per_key += v.size() / kr.size();
+  }
+  size_t n = std::max(max_bytes / std::max(bytes_per_key, (size_t)1), (size_t)1);
+  if (n >= kr.size()) return;
+  int num = (kr.size() + n - 1) / n;
+  for (int i = 0; i < num; ++i) {
+    Message* chunk = MessagePool::instance().Get();
+    chunk->task = msg.task;
+    chunk->recver = msg.recver;
+    chunk->task.mutable_chunk()->set_id(i);
+    chunk->task.mutable_chunk()->set_num(num);
+    SizeR lr(i * n, std::min((i + 1) * n, (size_t)kr.size()));
+    Range<Key>(kr.begin() + lr.begin(), kr.begin() + lr.end()).To(
+        chunk->task.mutable_chunk()->mutable_key_range());
+    for (const auto& v : msg.value) {
+      size_t k = v.size() / kr.size();
+      chunk->value.push_back(v.Segment(lr*k));
+    }
+    chunks->push_back(chunk);
+  }
+}
+
+void Message::Clear() {
+  task.Clear();
+  key.clear();
+  value.clear();
+  sender.clear();
+  recver.clear();
+  replied = false;
+  finished = true;
+  valid = true;
+  terminate = false;
+  callback = Callback();
+}
+
 size_t Message::mem_size() {
   size_t nbytes = task.SpaceUsed() + key.MemSize();
   for (const auto& v : value) nbytes += v.MemSize();
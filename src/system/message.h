@@ -1,6 +1,7 @@
 #pragma once
 #include "util/common.h"
 #include "util/shared_array.h"
+#include "util/object_pool.h"
 #include "system/proto/task.pb.h"
 #include "filter/proto/filter.pb.h"
 namespace PS {
@@ -55,6 +56,10 @@ struct Message {
   typedef std::function<void()> Callback;
   Callback callback;       // the callback when the associated request is finished
 
+  // resets to the state of a newly created message, but keeps the allocated
+  // memory of the task
+  void Clear();
+
   // debug
   std::string ShortDebugString() const;
   std::string DebugString() const;
@@ -102,6 +107,25 @@ template <typename V> DataType Message::EncodeType() {
   return DataType::OTHER;
 }
 
+/**
+ * @brief A pool of recycled messages, which are used by the system for the
+ * received messages and the sliced requests. A message from Get() is the same
+ * as a new Message(), and it can be freed by either Put() or delete.
+ */
+class MessagePool {
+ public:
+  SINGLETON(MessagePool);
+  Message* Get() { return pool_.Get(); }
+  void Put(Message* msg) {
+    if (msg == nullptr) return;
+    msg->Clear();
+    pool_.Put(msg);
+  }
+ private:
+  MessagePool() { }
+  ObjectPool<Message> pool_;
+};
+
 // Slice a "msg" according to key ranges "krs". "msg.key" must be ordered, and a
 // each value entry must have the same length.
 template <typename K> void SliceKOFVMessage(
@@ -146,6 +170,42 @@ template <typename K> void SliceKOFVMessage(
   }
 }
 
+// Splits the data of "msg" into chunks with at most "max_bytes" each, and
+// appends them to "chunks". The data are a list of ordered keys, and each value
+// entry has the same length. Nothing is appended if "msg" is small enough.
+template <typename K> void ChunkKOFVMessage(
+    const Message& msg, size_t max_bytes, std::vector<Message*>* chunks) {
+  SArray<K> key(msg.key);
+  if (key.empty()) return;
+  size_t bytes_per_key = sizeof(K);
+  for (const auto& v : msg.value) {
+    CHECK_EQ(v.size() % key.size(), 0);
+    bytes_per_key += v.size() / key.size();
+  }
+  size_t n = std::max(max_bytes / bytes_per_key, (size_t)1);
+  if (n >= key.size()) return;
+  int num = (key.size() + n - 1) / n;
+  for (int i = 0; i < num; ++i) {
+    Message* chunk = MessagePool::instance().Get();
+    chunk->task = msg.task;
+    chunk->recver = msg.recver;
+    chunk->task.mutable_chunk()->set_id(i);
+    chunk->task.mutable_chunk()->set_num(num);
+    SizeR lr(i * n, std::min((i + 1) * n, key.size()));
+    chunk->set_key(key.Segment(lr));
+    for (const auto& v : msg.value) {
+      size_t k = v.size() / key.size();
+      chunk->value.push_back(v.Segment(lr*k));
+    }
+    chunks->push_back(chunk);
+  }
+}
+
+// The same as above, but the data have no key. They are the dense values of
+// the keys in msg.task.key_range
+void ChunkDenseMessage(
+    const Message& msg, size_t max_bytes, std::vector<Message*>* chunks);
+
 } // namespace PS
 
 // inline std::ostream& operator<<(std::ostream& os, const Message& msg) {
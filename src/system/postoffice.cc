@@ -9,6 +9,16 @@ DEFINE_int32(report_interval, 0,
   "Servers/Workers report running status to the scheduler "
   "in every report_interval seconds. "
   "default: 0; if set to 0, heartbeat is disabled");
+DEFINE_int32(num_send_threads, 4, "number of threads sending messages, each "
+             "one serves a disjoint set of receivers");
+DEFINE_int32(max_fragment_size, 0, "split the data of a message into "
+             "fragments with at most this many KB, so that messages with "
+             "higher priority can overtake it. 0 means disabled");
+DEFINE_int32(pack_size, 0, "pack small messages to the same customer of a "
+             "node into one, which is sent once its size reaches this many KB. "
+             "0 means disabled");
+DEFINE_int32(pack_delay, 100, "the maximal time in microseconds a message "
+             "waits to be packed");
 
 DECLARE_string(interface);
 
@@ -16,16 +26,33 @@ Postoffice::Postoffice() { }
 
 Postoffice::~Postoffice() {
   if (recv_thread_) recv_thread_->join();
-  if (send_thread_) {
-    Message* stop = new Message(); stop->terminate = true; Queue(stop);
-    send_thread_->join();
+  if (pack_thread_) {
+    {
+      Lock lk(pack_mu_);
+      pack_done_ = true;
+      FlushPack(NodeID());
+    }
+    pack_cond_.notify_all();
+    pack_thread_->join();
+  }
+  for (auto& q : sending_queues_) {
+    // send it after all others
+    Message* stop = new Message(); stop->terminate = true;
+    q->push(stop, std::numeric_limits<int>::min());
   }
+  for (auto& t : send_threads_) t.join();
 }
 
 void Postoffice::Run(int* argc, char*** argv) {
   google::InitGoogleLogging((*argv)[0]);
   google::ParseCommandLineFlags(argc, argv, true);
 
+  // messages can be queued once the manager is initialized
+  for (int i = 0; i < std::max(FLAGS_num_send_threads, 1); ++i) {
+    sending_queues_.push_back(std::unique_ptr<ThreadsafePriorityQueue<Message*>>(
+        new ThreadsafePriorityQueue<Message*>()));
+  }
+
   manager_.Init((*argv)[0]);
 
   if (FLAGS_report_interval > 0) {
@@ -35,17 +62,23 @@ void Postoffice::Run(int* argc, char*** argv) {
   // start the I/O threads
   recv_thread_ =
       std::unique_ptr<std::thread>(new std::thread(&Postoffice::Recv, this));
-  send_thread_ =
-      std::unique_ptr<std::thread>(new std::thread(&Postoffice::Send, this));
+  for (size_t i = 0; i < sending_queues_.size(); ++i) {
+    send_threads_.push_back(std::thread(&Postoffice::Send, this, i));
+  }
+  if (FLAGS_pack_size > 0) {
+    pack_thread_ = std::unique_ptr<std::thread>(
+        new std::thread(&Postoffice::PackThread, this));
+  }
 
   manager_.Run();
 }
 
-void Postoffice::Send() {
+void Postoffice::Send(int i) {
   Message* msg;
+  auto& queue = *sending_queues_[i];
   while (true) {
-    sending_queue_.wait_and_pop(msg);
-    if (msg->terminate) break;
+    queue.wait_and_pop(msg);
+    if (msg->terminate) { delete msg; break; }
     size_t send_bytes = 0;
     manager_.van().Send(msg, &send_bytes);
     if (FLAGS_report_interval > 0) {
@@ -55,60 +88,256 @@ void Postoffice::Send() {
       // a request "msg" is safe to be deleted only if the response is received
       manager_.AddRequest(msg);
     } else {
-      delete msg;
+      MessagePool::instance().Put(msg);
     }
   }
 }
 
 void Postoffice::Queue(Message* msg) {
-  if (!msg->task.has_more()) {
-    sending_queue_.push(msg);
-  } else {
-    // do pack
+  if (msg->task.has_more()) {
+    // pack by the caller
     CHECK(msg->task.request());
     CHECK(msg->task.has_customer_id());
-    CHECK(!msg->has_data()) << " don't know how to pack data";
     Lock lk(pack_mu_);
     auto key = std::make_pair(msg->recver, msg->task.customer_id());
     auto& value = pack_[key];
     value.push_back(msg);
 
     if (!msg->task.more()) {
-      // it's the final message, pack and send
-      Message* pack_msg = new Message();
-      pack_msg->recver = msg->recver;
-      for (auto m : value) {
-        m->task.clear_more();
-        *pack_msg->task.add_task() = m->task;
-        delete m;
-      }
+      // it's the final message, pack and send. keep the order of messages to
+      // the same receiver
+      if (FLAGS_pack_size > 0) FlushPack(msg->recver);
+      Push(Pack(value));
       value.clear();
-      sending_queue_.push(pack_msg);
+    }
+  } else if (FLAGS_pack_size > 0) {
+    // pack by the time window
+    Lock lk(pack_mu_);
+    if (!Packable(msg)) {
+      // keep the order of messages to the same receiver
+      FlushPack(msg->recver);
+      Push(msg);
+      return;
+    }
+    auto& buf = pack_buf_[std::make_pair(msg->recver, msg->task.customer_id())];
+    if (buf.msgs.empty()) {
+      buf.deadline = std::chrono::steady_clock::now() +
+                     std::chrono::microseconds(FLAGS_pack_delay);
+      pack_cond_.notify_one();
+    }
+    buf.msgs.push_back(msg);
+    buf.bytes += msg->mem_size();
+    if (buf.bytes >= ((size_t)FLAGS_pack_size << 10)) {
+      Push(Pack(buf.msgs));
+      buf.msgs.clear();
+      buf.bytes = 0;
+    }
+  } else {
+    Push(msg);
+  }
+}
+
+bool Postoffice::Packable(Message* msg) {
+  return !msg->task.control() && msg->task.has_customer_id() &&
+      msg->task.task_size() == 0 && !msg->terminate &&
+      msg->mem_size() < ((size_t)FLAGS_pack_size << 10);
+}
+
+void Postoffice::FlushPack(const NodeID& recver) {
+  for (auto& it : pack_buf_) {
+    if (!recver.empty() && it.first.first != recver) continue;
+    auto& buf = it.second;
+    if (buf.msgs.empty()) continue;
+    Push(Pack(buf.msgs));
+    buf.msgs.clear();
+    buf.bytes = 0;
+  }
+}
+
+void Postoffice::PackThread() {
+  std::unique_lock<std::mutex> lk(pack_mu_);
+  while (!pack_done_) {
+    auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+    for (auto& it : pack_buf_) {
+      auto& buf = it.second;
+      if (buf.msgs.empty()) continue;
+      if (buf.deadline <= now) {
+        Push(Pack(buf.msgs));
+        buf.msgs.clear();
+        buf.bytes = 0;
+      } else {
+        next = std::min(next, buf.deadline);
+      }
+    }
+    if (next == std::chrono::steady_clock::time_point::max()) {
+      pack_cond_.wait(lk);
+    } else {
+      pack_cond_.wait_until(lk, next);
     }
   }
 }
 
+Message* Postoffice::Pack(const std::vector<Message*>& msgs) {
+  CHECK(!msgs.empty());
+  if (msgs.size() == 1) {
+    msgs[0]->task.clear_more();
+    return msgs[0];
+  }
+  Message* pack_msg = MessagePool::instance().Get();
+  pack_msg->recver = msgs[0]->recver;
+  for (auto m : msgs) {
+    m->task.clear_more();
+    Task* task = pack_msg->task.add_task();
+    *task = m->task;
+    // the data go to the values of the packed message
+    if (m->has_key()) {
+      task->set_has_key(true);
+      pack_msg->value.push_back(m->key);
+    } else {
+      task->clear_has_key();
+    }
+    task->set_num_value(m->value.size());
+    for (const auto& v : m->value) pack_msg->value.push_back(v);
+    if (m->task.has_priority() && (!pack_msg->task.has_priority() ||
+                                   m->task.priority() > pack_msg->task.priority())) {
+      pack_msg->task.set_priority(m->task.priority());
+    }
+    MessagePool::instance().Put(m);
+  }
+  return pack_msg;
+}
+
+void Postoffice::Push(Message* msg) {
+  int priority = msg->task.priority();
+  if (msg->task.control() && !msg->task.has_priority()) {
+    priority = std::numeric_limits<int>::max();
+  }
+  auto& queue = SendingQueue(msg->recver);
+  if (FLAGS_max_fragment_size > 0 && msg->has_data() &&
+      msg->mem_size() > ((size_t)FLAGS_max_fragment_size << 10)) {
+    // all fragments have the same priority, so they are sent in order
+    std::vector<Message*> frags;
+    Fragment(msg, &frags);
+    for (auto m : frags) queue.push(m, priority);
+  } else {
+    queue.push(msg, priority);
+  }
+}
+
+void Postoffice::Fragment(Message* msg, std::vector<Message*>* frags) {
+  size_t max_size = (size_t)FLAGS_max_fragment_size << 10;
+  std::vector<SArray<char>> data;
+  if (msg->has_key()) data.push_back(msg->key);
+  for (const auto& v : msg->value) data.push_back(v);
+
+  Message* first = MessagePool::instance().Get();
+  first->task = msg->task;
+  first->recver = msg->recver;
+  auto frag = first->task.mutable_fragment();
+  frag->set_id(fragment_id_ ++);
+  frag->set_has_key(msg->has_key());
+  first->task.clear_has_key();
+  frags->push_back(first);
+  int num = 0;
+  for (const auto& d : data) {
+    frag->add_size(d.size());
+    for (size_t pos = 0; pos < d.size(); pos += max_size) {
+      Message* m = num == 0 ? first : MessagePool::instance().Get();
+      if (num) {
+        m->recver = msg->recver;
+        m->task.set_request(msg->task.request());
+        m->task.set_customer_id(msg->task.customer_id());
+        m->task.mutable_fragment()->set_id(frag->id());
+        frags->push_back(m);
+      }
+      // zero-copy
+      m->value.push_back(d.Segment(SizeR(pos, std::min(pos + max_size, d.size()))));
+      ++ num;
+    }
+  }
+  frag->set_num(num);
+  MessagePool::instance().Put(msg);
+}
+
+Message* Postoffice::Assemble(Message* msg) {
+  auto key = std::make_pair(msg->sender, msg->task.fragment().id());
+  Message* first = nullptr;
+  if (msg->task.fragment().has_num()) {
+    first = fragments_[key] = msg;
+  } else {
+    auto it = fragments_.find(key);
+    CHECK(it != fragments_.end()) << "lost the first fragment from " << msg->sender;
+    first = it->second;
+    CHECK_EQ(msg->value.size(), 1);
+    first->value.push_back(msg->value[0]);
+    MessagePool::instance().Put(msg);
+  }
+  const auto& frag = first->task.fragment();
+  if ((int)first->value.size() < frag.num()) return nullptr;
+
+  // merge the pieces
+  std::vector<SArray<char>> pieces;
+  pieces.swap(first->value);
+  std::vector<SArray<char>> data;
+  size_t k = 0;
+  for (uint64 size : frag.size()) {
+    if (size == 0) {
+      data.push_back(SArray<char>());
+    } else if (size == pieces[k].size()) {
+      data.push_back(pieces[k++]);  // zero-copy
+    } else {
+      SArray<char> d(size);
+      for (size_t pos = 0; pos < size; ++k) {
+        memcpy(d.data() + pos, pieces[k].data(), pieces[k].size());
+        pos += pieces[k].size();
+      }
+      data.push_back(d);
+    }
+  }
+  CHECK_EQ(k, pieces.size());
+  size_t i = 0;
+  if (frag.has_key()) {
+    first->task.set_has_key(true);
+    first->key = data[i++];
+  }
+  for (; i < data.size(); ++i) first->value.push_back(data[i]);
+  first->task.clear_fragment();
+  fragments_.erase(key);
+  return first;
+}
+
 void Postoffice::Recv() {
   while (true) {
     // receive a message
-    Message* msg = new Message();
+    Message* msg = MessagePool::instance().Get();
     size_t recv_bytes = 0;
     CHECK(manager_.van().Recv(msg, &recv_bytes));
     if (FLAGS_report_interval > 0) {
       perf_monitor_.increaseInBytes(recv_bytes);
     }
 
+    if (msg->task.has_fragment()) {
+      msg = Assemble(msg);
+      if (msg == nullptr) continue;
+    }
+
     if (msg->task.task_size()) {
       // packed task
-      CHECK(!msg->has_data());
+      size_t k = 0;
       for (int i = 0; i < msg->task.task_size(); ++i) {
-        Message* unpack_msg = new Message();
+        Message* unpack_msg = MessagePool::instance().Get();
         unpack_msg->recver = msg->recver;
         unpack_msg->sender = msg->sender;
         unpack_msg->task = msg->task.task(i);
+        if (unpack_msg->task.has_key()) unpack_msg->key = msg->value[k++];
+        for (int j = 0; j < unpack_msg->task.num_value(); ++j) {
+          unpack_msg->value.push_back(msg->value[k++]);
+        }
+        unpack_msg->task.clear_num_value();
         if (!Process(unpack_msg)) break;
       }
-      delete msg;
+      MessagePool::instance().Put(msg);
     } else {
       if (!Process(msg)) break;
     }
@@ -120,7 +349,7 @@ bool Postoffice::Process(Message* msg) {
   // process this message
   if (msg->task.control()) {
     bool ret = manager_.Process(msg);
-    delete msg;
+    MessagePool::instance().Put(msg);
     return ret;
   } else {
     int id = msg->task.customer_id();
@@ -1,7 +1,7 @@
 #pragma once
 #include "util/common.h"
 #include "system/message.h"
-#include "util/threadsafe_queue.h"
+#include "util/threadsafe_priority_queue.h"
 #include "system/manager.h"
 #include "system/heartbeat_info.h"
 namespace PS {
@@ -24,6 +24,20 @@ class Postoffice {
    * @brief Queue a message into the sending buffer, which will be sent by the
    * sending thread. It is thread safe.
    *
+   * There are -num_send_threads sending threads, and each one has its own
+   * queue. Messages to the same receiver always go to the same queue, so they
+   * are sent in order, while a large message only blocks the receivers sharing
+   * its thread.
+   *
+   * A queue is ordered by the priority of messages, see Task::priority. If
+   * -max_fragment_size is set, a large message is sent as several fragments so
+   * that a message with higher priority can be sent in between.
+   *
+   * Messages to the same customer of a node can be packed into a single one.
+   * It happens if the *more* flag is set by the caller, or if -pack_size is
+   * set and the message is small. In the latter case, a message waits at most
+   * -pack_delay microseconds before being sent.
+   *
    * @param msg it will be DELETE by system after sent successfully. so do NOT
    * delete it before
    */
@@ -34,19 +48,55 @@ class Postoffice {
 
  private:
   Postoffice();
-  void Send();
+  void Send(int i);
   void Recv();
   bool Process(Message* msg);
+  // pushes "msg" into the sending queue of its receiver
+  void Push(Message* msg);
+  // the sending queue of "recver"
+  ThreadsafePriorityQueue<Message*>& SendingQueue(const NodeID& recver) {
+    return *sending_queues_[std::hash<NodeID>()(recver) % sending_queues_.size()];
+  }
   std::unique_ptr<std::thread> recv_thread_;
-  std::unique_ptr<std::thread> send_thread_;
-  ThreadsafeQueue<Message*> sending_queue_;
+  std::vector<std::thread> send_threads_;
+  std::vector<std::unique_ptr<ThreadsafePriorityQueue<Message*>>> sending_queues_;
+
+  // splits "msg" into fragments and deletes it
+  void Fragment(Message* msg, std::vector<Message*>* frags);
+  // returns the original message once all fragments are received, otherwise
+  // returns nullptr
+  Message* Assemble(Message* msg);
+  std::atomic<uint64> fragment_id_{0};
+  // received fragments, key: <sender, fragment_id>, value: the first fragment
+  // with the pieces received so far as its values
+  std::map<std::pair<NodeID, uint64>, Message*> fragments_;
 
   Manager manager_;
   HeartbeatInfo perf_monitor_;
 
-  // key: <sender, customer_id>, value: messages will be packed
+  // packs "msgs" into a single message and deletes them
+  Message* Pack(const std::vector<Message*>& msgs);
+  // the small messages packed by the time window
+  struct PackBuffer {
+    std::vector<Message*> msgs;
+    size_t bytes = 0;
+    std::chrono::steady_clock::time_point deadline;
+  };
+  // returns true if "msg" can be packed with others by the time window
+  bool Packable(Message* msg);
+  // sends the packed messages to "recver" (all receivers if empty). must hold
+  // pack_mu_
+  void FlushPack(const NodeID& recver);
+  // sends the packed messages on deadline
+  void PackThread();
+
+  // key: <recver, customer_id>, value: messages will be packed
   std::map<std::pair<NodeID, int>, std::vector<Message*>> pack_;
+  std::map<std::pair<NodeID, int>, PackBuffer> pack_buf_;
   std::mutex pack_mu_;
+  std::condition_variable pack_cond_;
+  std::unique_ptr<std::thread> pack_thread_;
+  bool pack_done_ = false;
 
   DISALLOW_COPY_AND_ASSIGN(Postoffice);
 };
@@ -9,26 +9,87 @@ namespace PS {
 // The presentation of a remote node used by Executor. It's not thread
 // safe, do not use them directly.
 
-// Track a request by its timestamp.
+// Track a request by its timestamp. Timestamps below a low watermark are all
+// finished, and the ones in a window above it are stored in a ring bitmap. The
+// window grows up to kMaxWindow timestamps, and never slides over an unfinished
+// timestamp: finishing one beyond the window is a CHECK failure. So every
+// timestamp should be finished eventually, a timestamp not sent to a node is
+// finished when it is skipped, see RemoteNode::SkipRequest.
 class RequestTracker {
  public:
-  RequestTracker() { }
+  RequestTracker() : bits_(kMinWindow / 64, 0) { }
   ~RequestTracker() { }
 
   // Returns true if timestamp "ts" is marked as finished.
-  bool IsFinished(int ts) {
-    return ts < 0 || (((int)data_.size() > ts) && data_[ts]);
+  bool IsFinished(int ts) const {
+    if (ts < low_) return true;
+    if (ts - low_ >= window()) return false;
+    return Get(ts);
   }
 
   // Mark timestamp "ts" as finished.
   void Finish(int ts) {
     CHECK_GE(ts, 0);
-    CHECK_LT(ts, 1000000);
-    if ((int)data_.size() <= ts) data_.resize(ts*2+5);
-    data_[ts] = true;
+    if (ts < low_) return;
+    while (ts - low_ >= window()) {
+      // never slide over an unfinished timestamp, it would be considered as
+      // a duplicate once received
+      CHECK_LT(window(), kMaxWindow) << "too many unfinished timestamps in ["
+                                     << low_ << ", " << ts << ")";
+      Grow();
+    }
+    Set(ts);
+    // advance the watermark
+    while (Get(low_)) { Clear(low_); ++ low_; }
   }
+
+  // Mark all timestamps below "end" as finished. It costs O(window) rather
+  // than O(end)
+  void FinishBelow(int end) {
+    if (end <= low_) return;
+    if (end - low_ >= window()) {
+      std::fill(bits_.begin(), bits_.end(), 0);
+    } else {
+      for (int ts = low_; ts < end; ++ts) Clear(ts);
+    }
+    low_ = end;
+    while (Get(low_)) { Clear(low_); ++ low_; }
+  }
+
+  // All timestamps below it are finished
+  int low() const { return low_; }
+
  private:
-  std::vector<bool> data_;
+  static const int kMinWindow = 1 << 10;
+  static const int kMaxWindow = 1 << 20;
+
+  int window() const { return (int)bits_.size() * 64; }
+  bool Get(int ts) const {
+    int i = ts & (window() - 1);
+    return (bits_[i >> 6] >> (i & 63)) & 1;
+  }
+  void Set(int ts) {
+    int i = ts & (window() - 1);
+    bits_[i >> 6] |= (uint64)1 << (i & 63);
+  }
+  void Clear(int ts) {
+    int i = ts & (window() - 1);
+    bits_[i >> 6] &= ~((uint64)1 << (i & 63));
+  }
+  // doubles the window size
+  void Grow() {
+    std::vector<uint64> old;
+    old.swap(bits_);
+    int old_window = (int)old.size() * 64;
+    bits_.resize(old.size() * 2, 0);
+    for (int ts = low_; ts < low_ + old_window; ++ts) {
+      int i = ts & (old_window - 1);
+      if ((old[i >> 6] >> (i & 63)) & 1) Set(ts);
+    }
+  }
+
+  int low_ = 0;
+  std::vector<uint64> bits_;
 };
 
 // A remote node
@@ -45,10 +106,24 @@ struct RemoteNode {
   Node node;         // the remote node
   bool alive = true; // aliveness
 
-  // timestamp tracker
+  // timestamp tracker. not used by a group node, whose timestamps are finished
+  // if they are finished by all alive nodes in the group. otherwise the
+  // timestamps a group node is not checked with would never be finished
   RequestTracker sent_req_tracker;
   RequestTracker recv_req_tracker;
 
+  // the timestamps of the requests submitted since the last request sent to
+  // this node but not sent to it, which are carried by the next request, see
+  // Task::skipped_time. otherwise the receiver's tracker would stall on them
+  void SkipRequest(int ts) {
+    if (!skipped_reqs.empty() && skipped_reqs.back().end() == ts) {
+      ++ skipped_reqs.back().end();
+    } else {
+      skipped_reqs.push_back(Range<int>(ts, ts + 1));
+    }
+  }
+  std::vector<Range<int>> skipped_reqs;
+
   // node group info. if "node" is a node group, then "group" contains all node
   // pointer in this group. otherwise, group contains "this"
   void AddGroupNode(RemoteNode* rnode);
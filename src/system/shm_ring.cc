@@ -0,0 +1,133 @@
+#include "system/shm_ring.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+namespace PS {
+
+ShmRing::~ShmRing() {
+  if (addr_) munmap(addr_, mapped_size_);
+  if (owner_) shm_unlink(name_.c_str());
+}
+
+string ShmRing::Name(const NodeID& sender, const NodeID& recver) {
+  string name = "/ps_" + sender + "_to_" + recver;
+  for (size_t i = 1; i < name.size(); ++i) {
+    if (!isalnum(name[i])) name[i] = '_';
+  }
+  return name;
+}
+
+bool ShmRing::Map(int fd, size_t size) {
+  void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    LOG(WARNING) << "failed to mmap " << name_ << ": " << strerror(errno);
+    return false;
+  }
+  addr_ = (char*) addr;
+  mapped_size_ = size;
+  base_ = addr_ + kAlign;
+  return true;
+}
+
+bool ShmRing::Create(const string& name, size_t size) {
+  CHECK(addr_ == nullptr);
+  name_ = name;
+  size = (size + kAlign - 1) / kAlign * kAlign;
+  shm_unlink(name_.c_str());
+  int fd = shm_open(name_.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+  if (fd == -1) {
+    LOG(WARNING) << "failed to create " << name_ << ": " << strerror(errno);
+    return false;
+  }
+  if (ftruncate(fd, size + kAlign) != 0) {
+    LOG(WARNING) << "failed to resize " << name_ << ": " << strerror(errno);
+    close(fd);
+    shm_unlink(name_.c_str());
+    return false;
+  }
+  if (!Map(fd, size + kAlign)) {
+    shm_unlink(name_.c_str());
+    return false;
+  }
+  owner_ = true;
+  capacity_ = size;
+  // unique among the segments with this name, which are created by different
+  // processes or at different times
+  generation_ = std::chrono::system_clock::now().time_since_epoch().count() ^
+                ((uint64)getpid() << 40);
+  Meta* meta = (Meta*) addr_;
+  meta->capacity = capacity_;
+  meta->generation = generation_;
+  meta->magic = kMagic;
+  return true;
+}
+
+bool ShmRing::Attach(const string& name) {
+  CHECK(addr_ == nullptr);
+  name_ = name;
+  int fd = shm_open(name_.c_str(), O_RDWR, 0600);
+  if (fd == -1) {
+    LOG(WARNING) << "failed to open " << name_ << ": " << strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size <= kAlign) {
+    LOG(WARNING) << "invalid shared memory segment " << name_;
+    close(fd);
+    return false;
+  }
+  if (!Map(fd, st.st_size)) return false;
+  Meta* meta = (Meta*) addr_;
+  CHECK_EQ(meta->magic, kMagic) << name_ << " is not a ring buffer";
+  capacity_ = meta->capacity;
+  generation_ = meta->generation;
+  CHECK_EQ(capacity_ + kAlign, mapped_size_);
+  return true;
+}
+
+int64 ShmRing::Alloc(size_t size) {
+  uint64 need = (sizeof(Block) + size + kAlign - 1) / kAlign * kAlign;
+  if (need > capacity_) return -1;
+
+  Reclaim();
+
+  // a block cannot cross the end of the ring. fill the remaining space with a
+  // free block and start from the beginning
+  uint64 pos = head_ % capacity_;
+  if (pos + need > capacity_) {
+    uint64 rest = capacity_ - pos;
+    if (head_ + rest - tail_ > capacity_) return -1;
+    Block* b = block(head_);
+    b->size = rest;
+    b->state.store(kFree, std::memory_order_release);
+    head_ += rest;
+    pos = 0;
+    Reclaim();
+  }
+  if (head_ + need - tail_ > capacity_) return -1;
+
+  Block* b = block(head_);
+  b->size = need;
+  b->state.store(kBusy, std::memory_order_relaxed);
+  head_ += need;
+  return pos + sizeof(Block);
+}
+
+void ShmRing::Reclaim() {
+  // advance the tail over the blocks released by the consumer
+  while (tail_ < head_) {
+    Block* b = block(tail_);
+    if (b->state.load(std::memory_order_acquire) != kFree) break;
+    tail_ += b->size;
+  }
+}
+
+void ShmRing::Free(int64 offset) {
+  Block* b = (Block*)(base_ + offset - sizeof(Block));
+  b->state.store(kFree, std::memory_order_release);
+}
+
+} // namespace PS
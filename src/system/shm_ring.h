@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+#include "util/common.h"
+namespace PS {
+
+/**
+ * @brief A ring buffer placed in a POSIX shared memory segment, used by Van to
+ * pass data between two nodes on the same machine.
+ *
+ * There is exactly one producer (the sending node), which creates the segment,
+ * and one consumer (the receiving node), which attaches it by name. The
+ * producer allocates a block, copies the data into it, and then sends the
+ * block offset to the consumer by other means. The consumer reads the block
+ * in place and releases it once done. Blocks can be released in any order,
+ * the producer reclaims the consecutive released blocks at the tail of the
+ * ring when allocating. No lock is needed: the producer owns the head and the
+ * tail, while the consumer only flips the state of a block.
+ */
+class ShmRing {
+ public:
+  ShmRing() { }
+  ~ShmRing();
+
+  /**
+   * @brief Creates a new segment with "size" bytes as the producer. An existing
+   * segment with the same name is overwritten.
+   */
+  bool Create(const string& name, size_t size);
+
+  /**
+   * @brief Attaches to the segment created by the producer.
+   */
+  bool Attach(const string& name);
+
+  /**
+   * @brief Allocates a block with "size" bytes, returns its offset or -1 if
+   * the ring is full. Only be called by the producer.
+   */
+  int64 Alloc(size_t size);
+
+  /**
+   * @brief Releases the block at "offset". Called by the consumer, or by the
+   * producer if the block has never been handed to the consumer.
+   */
+  void Free(int64 offset);
+
+  /// @brief Returns the data pointer of the block at "offset"
+  char* data(int64 offset) { return base_ + offset; }
+
+  /// @brief Returns the generation of the segment, which differs each time
+  /// a segment with the same name is created. A consumer attached to an old
+  /// one should attach again
+  uint64 generation() const { return generation_; }
+
+  /// @brief Returns a valid segment name for the data sent from "sender" to "recver"
+  static string Name(const NodeID& sender, const NodeID& recver);
+
+ private:
+  // the layout of the segment: [Meta | block | block | ... ]
+  struct Meta {
+    uint64 magic;
+    uint64 capacity;  // the size of the ring, excluding Meta
+    uint64 generation;
+  };
+  struct Block {
+    std::atomic<uint32> state;
+    uint32 reserved;
+    uint64 size;  // including this header
+  };
+  static const uint32 kBusy = 1;
+  static const uint32 kFree = 0;
+  static const uint64 kMagic = 0x70734d656d52696eULL;
+  static const size_t kAlign = 64;
+
+  bool Map(int fd, size_t size);
+  void Reclaim();
+  Block* block(uint64 pos) { return (Block*)(base_ + pos % capacity_); }
+
+  string name_;
+  bool owner_ = false;
+  char* addr_ = nullptr;  // the mapped address
+  size_t mapped_size_ = 0;
+  char* base_ = nullptr;  // the first byte of the ring
+  uint64 capacity_ = 0;
+  uint64 generation_ = 0;
+
+  // only used by the producer. both are monotonically increasing
+  uint64 head_ = 0;
+  uint64 tail_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(ShmRing);
+};
+
+} // namespace PS
@@ -0,0 +1,433 @@
+#include "system/tcp_transport.h"
+#include "util/shared_array_inl.h"
+#include <string.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+namespace PS {
+
+DECLARE_bool(local);
+DECLARE_int32(bind_to);
+DECLARE_int32(num_io_threads);
+DECLARE_int32(socket_buffer);
+
+TcpTransport::TcpTransport() {
+  stop_fd_ = eventfd(0, EFD_NONBLOCK);
+  CHECK_NE(stop_fd_, -1) << strerror(errno);
+  int n = std::max(FLAGS_num_io_threads, 1);
+  for (int i = 0; i < n; ++i) {
+    int ep = epoll_create1(0);
+    CHECK_NE(ep, -1) << strerror(errno);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &stop_fd_;
+    CHECK(!epoll_ctl(ep, EPOLL_CTL_ADD, stop_fd_, &ev)) << strerror(errno);
+    epolls_.push_back(ep);
+  }
+}
+
+TcpTransport::~TcpTransport() {
+  done_ = true;
+  uint64 one = 1;
+  CHECK_EQ(write(stop_fd_, &one, sizeof(one)), sizeof(one));
+  for (auto& t : io_threads_) t.join();
+  for (int ep : epolls_) close(ep);
+  for (auto& it : out_) {
+    close(it.second->fd);
+    delete it.second;
+  }
+  for (Conn* conn : closed_) delete conn;
+  if (listener_ != -1) close(listener_);
+  close(stop_fd_);
+  recv_queue_.push(nullptr);
+}
+
+void TcpTransport::SetSockOpt(int fd) {
+  if (!FLAGS_local) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  if (FLAGS_socket_buffer > 0) {
+    int buf = FLAGS_socket_buffer << 10;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+  }
+}
+
+void TcpTransport::Bind(const Node& my_node) {
+  string addr;
+  if (FLAGS_local) {
+    addr = "/tmp/" + my_node.id();
+    listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK_NE(listener_, -1) << strerror(errno);
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    CHECK_LT(addr.size(), sizeof(sa.sun_path));
+    strcpy(sa.sun_path, addr.c_str());
+    unlink(addr.c_str());
+    CHECK(!bind(listener_, (struct sockaddr*)&sa, sizeof(sa)))
+        << "bind to " << addr << " failed: " << strerror(errno);
+  } else {
+    int port = FLAGS_bind_to;
+    if (!port) {
+      CHECK(my_node.has_port()) << my_node.ShortDebugString();
+      port = my_node.port();
+    }
+    addr = "*:" + std::to_string(port);
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK_NE(listener_, -1) << strerror(errno);
+    int one = 1;
+    setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(port);
+    CHECK(!bind(listener_, (struct sockaddr*)&sa, sizeof(sa)))
+        << "bind to " << addr << " failed: " << strerror(errno);
+  }
+  CHECK(!listen(listener_, 1024)) << strerror(errno);
+  CHECK(!fcntl(listener_, F_SETFL, fcntl(listener_, F_GETFL) | O_NONBLOCK));
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  CHECK(!epoll_ctl(epolls_[0], EPOLL_CTL_ADD, listener_, &ev))
+      << strerror(errno);
+
+  for (size_t i = 0; i < epolls_.size(); ++i) {
+    io_threads_.push_back(std::thread(&TcpTransport::IOThread, this, i));
+  }
+  VLOG(1) << "BIND address " << addr;
+}
+
+bool TcpTransport::Connect(const Node& my_node, const Node& node) {
+  NodeID id = node.id();
+  {
+    Lock l(out_mu_);
+    if (out_.find(id) != out_.end()) return true;
+  }
+
+  int fd = -1;
+  string addr;
+  if (FLAGS_local) {
+    addr = "/tmp/" + id;
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    CHECK_LT(addr.size(), sizeof(sa.sun_path));
+    strcpy(sa.sun_path, addr.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+      close(fd); fd = -1;
+    }
+  } else {
+    addr = node.hostname() + ":" + std::to_string(node.port());
+    struct addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(node.hostname().c_str(),
+                    std::to_string(node.port()).c_str(), &hints, &res) == 0) {
+      for (auto p = res; p != nullptr; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd == -1) continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+        close(fd); fd = -1;
+      }
+      freeaddrinfo(res);
+    }
+  }
+  if (fd == -1) {
+    LOG(WARNING) << "connect to " + addr + " failed: " + strerror(errno);
+    return false;
+  }
+  SetSockOpt(fd);
+
+  Conn* conn = new Conn();
+  conn->fd = fd;
+  conn->id = id;
+  conn->outgoing = true;
+
+  // tell the remote node who I am
+  SArray<char> my_id;
+  my_id.CopyFrom(my_node.id().data(), my_node.id().size());
+  if (!WriteFrames(conn, {my_id})) {
+    LOG(WARNING) << "handshake with " + addr + " failed: " + strerror(errno);
+    close(fd);
+    delete conn;
+    return false;
+  }
+
+  Lock l(out_mu_);
+  out_[id] = conn;
+  VLOG(1) << "CONNECT to " << id << " [" << addr << "]";
+  return true;
+}
+
+void TcpTransport::Disconnect(const NodeID& id) {
+  Conn* conn = nullptr;
+  {
+    Lock l(out_mu_);
+    auto it = out_.find(id);
+    if (it == out_.end()) return;
+    conn = it->second;
+    out_.erase(it);
+  }
+  {
+    // wait the ongoing writing
+    Lock l(conn->mu);
+    // remove it from the epoll set before closing, otherwise a new socket
+    // which reuses the fd could be removed by CloseConn
+    if (conn->ep != -1) epoll_ctl(conn->ep, EPOLL_CTL_DEL, conn->fd, NULL);
+    shutdown(conn->fd, SHUT_RDWR);
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  if (conn->ep == -1) {
+    delete conn;
+  } else {
+    // a monitored connection may still be touched by an IO thread
+    Lock l(out_mu_);
+    closed_.push_back(conn);
+  }
+}
+
+bool TcpTransport::Send(
+    const NodeID& id, const std::vector<SArray<char>>& frames) {
+  Conn* conn = nullptr;
+  {
+    Lock l(out_mu_);
+    auto it = out_.find(id);
+    if (it == out_.end()) {
+      LOG(WARNING) << "there is no socket to node " + id;
+      return false;
+    }
+    conn = it->second;
+  }
+  Lock l(conn->mu);
+  if (!WriteFrames(conn, frames)) {
+    LOG(WARNING) << "failed to send message to node [" << id
+                 << "] errno: " << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool TcpTransport::WriteFrames(
+    Conn* conn, const std::vector<SArray<char>>& frames) {
+  size_t n = frames.size();
+  Header head;
+  head.magic = kMagic;
+  head.num_frames = n;
+  std::vector<uint64> sizes(n);
+  std::vector<struct iovec> iov;
+  iov.reserve(n + 2);
+  iov.push_back({&head, sizeof(head)});
+  for (size_t i = 0; i < n; ++i) sizes[i] = frames[i].size();
+  iov.push_back({sizes.data(), n * sizeof(uint64)});
+  for (size_t i = 0; i < n; ++i) {
+    if (sizes[i]) iov.push_back({frames[i].data(), sizes[i]});
+  }
+
+  size_t k = 0;
+  while (k < iov.size()) {
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov[k];
+    mh.msg_iovlen = std::min(iov.size() - k, (size_t)IOV_MAX);
+    ssize_t w = sendmsg(conn->fd, &mh, MSG_NOSIGNAL);
+    if (w < 0) {
+      if (errno == EINTR) continue;  // may be interupted by profiler
+      return false;
+    }
+    // skip the written bytes
+    while (w > 0) {
+      if ((size_t)w >= iov[k].iov_len) {
+        w -= iov[k].iov_len;
+        ++ k;
+      } else {
+        iov[k].iov_base = (char*)iov[k].iov_base + w;
+        iov[k].iov_len -= w;
+        w = 0;
+      }
+    }
+  }
+  return true;
+}
+
+bool TcpTransport::Recv(NodeID* sender, std::vector<SArray<char>>* frames) {
+  Received* msg;
+  recv_queue_.wait_and_pop(msg);
+  if (msg == nullptr) {
+    // stopped, wake other receivers
+    recv_queue_.push(nullptr);
+    return false;
+  }
+  *sender = msg->sender;
+  *frames = msg->frames;
+  delete msg;
+  return true;
+}
+
+void TcpTransport::Monitor(const NodeID& id, const DisconnectHandler& handler) {
+  disconnect_handler_ = handler;
+  monitor_id_ = id;
+  if (id.empty()) {
+    monitor_incoming_ = true;
+  } else {
+    Lock l(out_mu_);
+    auto it = out_.find(id);
+    CHECK(it != out_.end()) << "not connected to " << id;
+    // the remote node never writes to this connection, it becomes readable
+    // only if closed
+    AddConn(it->second);
+  }
+}
+
+void TcpTransport::AddConn(Conn* conn) {
+  if (!conn->outgoing) {
+    CHECK(!fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK));
+    conn->stage = Conn::HEADER;
+    conn->dst = (char*)&conn->head;
+    conn->want = sizeof(Header);
+    conn->got = 0;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.ptr = conn;
+  conn->ep = epolls_[next_io_ ++ % epolls_.size()];
+  CHECK(!epoll_ctl(conn->ep, EPOLL_CTL_ADD, conn->fd, &ev)) << strerror(errno);
+}
+
+void TcpTransport::CloseConn(Conn* conn) {
+  NodeID id = conn->id;
+  if (conn->outgoing) {
+    // it will be closed by Disconnect
+    {
+      Lock l(conn->mu);
+      if (conn->fd != -1) epoll_ctl(conn->ep, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    if (!done_ && id == monitor_id_) disconnect_handler_(id);
+    return;
+  }
+  close(conn->fd);
+  delete conn;
+  if (!done_ && monitor_incoming_ && !id.empty()) disconnect_handler_(id);
+}
+
+void TcpTransport::IOThread(int i) {
+  const int kMaxEvents = 64;
+  struct epoll_event events[kMaxEvents];
+  int ep = epolls_[i];
+  while (!done_) {
+    int n = epoll_wait(ep, events, kMaxEvents, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;  // may be interupted by profiler
+      LOG(WARNING) << "epoll_wait failed: " << strerror(errno);
+      break;
+    }
+    for (int j = 0; j < n; ++j) {
+      void* ptr = events[j].data.ptr;
+      if (ptr == &stop_fd_) return;
+      if (ptr == nullptr) {
+        // new connections
+        while (true) {
+          int fd = accept(listener_, NULL, NULL);
+          if (fd == -1) break;
+          SetSockOpt(fd);
+          Conn* conn = new Conn();
+          conn->fd = fd;
+          AddConn(conn);
+        }
+        continue;
+      }
+      Conn* conn = (Conn*)ptr;
+      if (!ReadConn(conn)) CloseConn(conn);
+    }
+  }
+}
+
+bool TcpTransport::ReadConn(Conn* c) {
+  // limit the number of reads for fairness, epoll will report it again if
+  // there are still bytes
+  for (int k = 0; k < 16; ) {
+    if (c->begin == c->end) {
+      // read a large frame directly into its destination, otherwise fill the
+      // buffer
+      bool direct = c->stage == Conn::FRAME && c->want - c->got >= kBufSize;
+      char* dst = direct ? c->dst + c->got : c->buf;
+      size_t len = direct ? c->want - c->got : kBufSize;
+      ssize_t r = read(c->fd, dst, len);
+      ++ k;
+      if (r == 0) return false;
+      if (r < 0) {
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      if (c->outgoing) continue;  // should not happen
+      if (direct) {
+        c->got += r;
+      } else {
+        c->begin = 0;
+        c->end = r;
+      }
+    } else {
+      size_t len = std::min(c->end - c->begin, c->want - c->got);
+      memcpy(c->dst + c->got, c->buf + c->begin, len);
+      c->begin += len;
+      c->got += len;
+    }
+    while (c->got == c->want) NextStage(c);
+  }
+  return true;
+}
+
+void TcpTransport::NextStage(Conn* c) {
+  if (c->stage == Conn::HEADER) {
+    CHECK_EQ(c->head.magic, kMagic) << "invalid message from " << c->id;
+    c->sizes.resize(c->head.num_frames);
+    c->stage = Conn::SIZES;
+    c->dst = (char*)c->sizes.data();
+    c->want = c->sizes.size() * sizeof(uint64);
+    c->got = 0;
+    return;
+  }
+  if (c->stage == Conn::FRAME || c->sizes.empty()) {
+    if (c->frames.size() == c->sizes.size()) {
+      // a complete message
+      if (c->id.empty()) {
+        CHECK_EQ(c->frames.size(), 1);
+        c->id = string(c->frames[0].data(), c->frames[0].size());
+      } else {
+        Received* msg = new Received();
+        msg->sender = c->id;
+        msg->frames.swap(c->frames);
+        recv_queue_.push(msg);
+      }
+      c->frames.clear();
+      c->stage = Conn::HEADER;
+      c->dst = (char*)&c->head;
+      c->want = sizeof(Header);
+      c->got = 0;
+      return;
+    }
+  }
+  // the next frame
+  SArray<char> frame(c->sizes[c->frames.size()]);
+  c->frames.push_back(frame);
+  c->stage = Conn::FRAME;
+  c->dst = frame.data();
+  c->want = frame.size();
+  c->got = 0;
+}
+
+} // namespace PS
@@ -0,0 +1,107 @@
+#pragma once
+#include "system/transport.h"
+#include "util/threadsafe_queue.h"
+#include <atomic>
+namespace PS {
+
+/**
+ * @brief A native TCP transport built on epoll.
+ *
+ * As the zmq one, a node accepts connections from all other nodes to receive
+ * messages, and sends messages through a connection per remote node. The first
+ * message on a connection carries the id of the connecting node.
+ *
+ * A message is written by a single writev call (if the socket buffer allows)
+ * with the following layout, so the task and all key/value arrays are sent
+ * without being copied into a contiguous buffer:
+ *
+ *   [Header][size of frame 0]...[size of frame n-1][frame 0]...[frame n-1]
+ *
+ * Incoming connections are distributed over -num_io_threads threads, each of
+ * which runs its own epoll loop and parses messages from a per-connection
+ * buffer, large frames are read into their final place directly.
+ */
+class TcpTransport : public Transport {
+ public:
+  TcpTransport();
+  virtual ~TcpTransport();
+
+  virtual void Bind(const Node& my_node);
+  virtual bool Connect(const Node& my_node, const Node& node);
+  virtual void Disconnect(const NodeID& id);
+  virtual bool Send(const NodeID& id, const std::vector<SArray<char>>& frames);
+  virtual bool Recv(NodeID* sender, std::vector<SArray<char>>* frames);
+  virtual void Monitor(const NodeID& id, const DisconnectHandler& handler);
+
+ private:
+  struct Header {
+    uint32 magic;
+    uint32 num_frames;
+  };
+  static const uint32 kMagic = 0x70734e54;
+  static const size_t kBufSize = 1 << 16;
+
+  // a connection
+  struct Conn {
+    int fd = -1;
+    NodeID id;              // the remote node
+    bool outgoing = false;  // created by Connect, only used for writing
+    int ep = -1;            // the epoll set it is added into
+    std::mutex mu;          // protects writing
+
+    // the reading state. "want" bytes are going to be read into "dst"
+    enum Stage { HEADER, SIZES, FRAME } stage = HEADER;
+    char* dst = nullptr;
+    size_t want = 0;
+    size_t got = 0;
+    Header head;
+    std::vector<uint64> sizes;
+    std::vector<SArray<char>> frames;
+
+    // the buffered bytes are in [begin, end)
+    char buf[kBufSize];
+    size_t begin = 0;
+    size_t end = 0;
+  };
+
+  struct Received {
+    NodeID sender;
+    std::vector<SArray<char>> frames;
+  };
+
+  void IOThread(int i);
+  // adds a connection to the epoll set of a IO thread
+  void AddConn(Conn* conn);
+  // reads all available bytes of a connection, returns false if the
+  // connection is closed
+  bool ReadConn(Conn* conn);
+  // moves to the next reading stage
+  void NextStage(Conn* conn);
+  void CloseConn(Conn* conn);
+  void SetSockOpt(int fd);
+  bool WriteFrames(Conn* conn, const std::vector<SArray<char>>& frames);
+
+  int listener_ = -1;
+  std::vector<int> epolls_;
+  std::vector<std::thread> io_threads_;
+  std::atomic<int> next_io_{0};
+  int stop_fd_ = -1;
+  std::atomic<bool> done_{false};
+
+  // outgoing connections, <node_id, conn>
+  std::unordered_map<NodeID, Conn*> out_;
+  // disconnected connections which may still be touched by an IO thread,
+  // they are deleted after the IO threads are stopped
+  std::vector<Conn*> closed_;
+  std::mutex out_mu_;
+
+  ThreadsafeQueue<Received*> recv_queue_;
+
+  DisconnectHandler disconnect_handler_;
+  NodeID monitor_id_;
+  bool monitor_incoming_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(TcpTransport);
+};
+
+} // namespace PS
@@ -0,0 +1,58 @@
+#pragma once
+#include "util/common.h"
+#include "util/shared_array.h"
+#include "system/proto/node.pb.h"
+namespace PS {
+
+/**
+ * @brief The network backend used by Van.
+ *
+ * A message is a list of frames. Van puts the serialized task into the first
+ * frame, and the keys and values into the following ones. A transport only
+ * moves frames between nodes, it knows nothing about tasks. Frames are not
+ * copied when sending, the transport holds a reference until they are sent.
+ */
+class Transport {
+ public:
+  Transport() { }
+  virtual ~Transport() { }
+
+  /**
+   * @brief Creates a transport by its name: "zmq" or "tcp"
+   */
+  static Transport* Create(const string& type);
+
+  /**
+   * @brief Binds to the port (or the local address if -local is set) of my node
+   */
+  virtual void Bind(const Node& my_node) = 0;
+
+  /**
+   * @brief Connects to "node". Messages sent via this connection are identified
+   * by the id of "my_node" at the receiver side. Do nothing if connected.
+   */
+  virtual bool Connect(const Node& my_node, const Node& node) = 0;
+  virtual void Disconnect(const NodeID& id) = 0;
+
+  /**
+   * @brief Sends frames to node "id". It returns once the frames are handed to
+   * the system.
+   */
+  virtual bool Send(const NodeID& id, const std::vector<SArray<char>>& frames) = 0;
+
+  /**
+   * @brief Receives a message, blocked until there is one.
+   */
+  virtual bool Recv(NodeID* sender, std::vector<SArray<char>>* frames) = 0;
+
+  typedef std::function<void(const NodeID&)> DisconnectHandler;
+  /**
+   * @brief Starts monitoring the liveness of connections. If "id" is empty,
+   * then monitors all incoming connections. Otherwise only monitors the
+   * connection to node "id". "handler" is called with the node id once a
+   * connection is lost.
+   */
+  virtual void Monitor(const NodeID& id, const DisconnectHandler& handler) = 0;
+};
+
+} // namespace PS
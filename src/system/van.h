@@ -2,11 +2,14 @@
 #include "util/common.h"
 #include "system/proto/node.pb.h"
 #include "system/message.h"
+#include "system/shm_ring.h"
+#include "system/transport.h"
+#include "system/wire_format.h"
 namespace PS {
 
 /**
- * @brief Van sends (receives) packages to (from) a node The current
- * implementation uses ZeroMQ
+ * @brief Van sends (receives) packages to (from) a node. The network backend
+ * is chosen by -van_type, see Transport
  *
  */
 class Van {
@@ -27,27 +30,28 @@ class Van {
   Node& my_node() { return my_node_; }
   Node& scheduler() { return scheduler_; };
  private:
-  // bind to my port
-  void Bind();
+  bool IsScheduler() { return my_node_.role() == Node::SCHEDULER; }
 
-  static void FreeData(void *data, void *hint) {
-    if (hint == NULL) {
-      delete [] (char*)data;
-    } else {
-      delete (SArray<char>*)hint;
-    }
+  // shared memory between nodes on the same machine
+  bool IsLocal(const NodeID& id) {
+    Lock l(mu_);
+    auto it = hostnames_.find(id);
+    return it != hostnames_.end() && it->second == my_node_.hostname();
   }
+  // copies the data of "msg" into the ring buffer shared with the receiver,
+  // returns false if the ring is full
+  bool SendToShm(Message* msg);
+  void RecvFromShm(Message* msg);
+  std::atomic<bool> use_shm_{false};
+  // rings I write to, <recver, ring>
+  std::unordered_map<NodeID, std::shared_ptr<ShmRing>> shm_send_;
+  // rings I read from, <sender, ring>
+  std::unordered_map<NodeID, std::shared_ptr<ShmRing>> shm_recv_;
 
-  bool IsScheduler() { return my_node_.role() == Node::SCHEDULER; }
-  // for scheduler: monitor the liveness of all other nodes
-  // for other nodes: monitor the liveness of the scheduler
-  void Monitor();
-
-  void *context_ = nullptr;
-  void *receiver_ = nullptr;
+  Transport* transport_ = nullptr;
+  WireFormat wire_;
   Node my_node_;
   Node scheduler_;
-  std::unordered_map<NodeID, void *> senders_;
 
   DISALLOW_COPY_AND_ASSIGN(Van);
 
@@ -59,11 +63,9 @@ class Van {
   size_t sent_to_others_ = 0;
   size_t received_from_local_ = 0;
   size_t received_from_others_ = 0;
-
-  // for monitor
-  std::unordered_map<int, NodeID> fd_to_nodeid_;
-  std::mutex fd_to_nodeid_mu_;
-  std::thread* monitor_thread_;
+  // Send is called by several threads concurrently. protects hostnames_,
+  // shm_send_ and the statistics
+  std::mutex mu_;
 
   // debug performance
   double send_time_ = 0;
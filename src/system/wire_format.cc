@@ -0,0 +1,145 @@
+#include "system/wire_format.h"
+#include "util/shared_array_inl.h"
+namespace PS {
+
+DEFINE_bool(binary_header, true, "encode the frequent fields of a data task "
+            "into a binary header rather than protobuf");
+
+SArray<char> WireFormat::Alloc(size_t size) {
+  if (size > kBufSize) return SArray<char>(size);
+  char* p = nullptr;
+  {
+    Lock l(pool_->mu);
+    if (!pool_->free.empty()) {
+      p = pool_->free.back();
+      pool_->free.pop_back();
+    }
+  }
+  if (p == nullptr) p = new char[kBufSize];
+  SArray<char> buf(p, size, false);
+  std::shared_ptr<Pool> pool = pool_;
+  buf.pointer().reset(p, [pool](char* p) { pool->Put(p); });
+  return buf;
+}
+
+SArray<char> WireFormat::Encode(Task* task) {
+  Header head;
+  if (!FLAGS_binary_header || !Extract(task, &head)) {
+    size_t size = task->ByteSize();
+    SArray<char> buf = Alloc(size);
+    CHECK(task->SerializeToArray(buf.data(), size))
+        << "failed to serialize " << task->ShortDebugString();
+    return buf;
+  }
+
+  // the rare fields
+  size_t size = task->ByteSize();
+  SArray<char> buf = Alloc(sizeof(Header) + size);
+  memcpy(buf.data(), &head, sizeof(Header));
+  if (size) {
+    CHECK(task->SerializeToArray(buf.data() + sizeof(Header), size))
+        << "failed to serialize " << task->ShortDebugString();
+  }
+  Restore(head, task);
+  return buf;
+}
+
+bool WireFormat::Decode(const char* buf, size_t size, Task* task) {
+  if (size == 0 || (uint8)buf[0] != kMagic) {
+    return task->ParseFromArray(buf, size);
+  }
+  if (size < sizeof(Header)) return false;
+  Header head;
+  memcpy(&head, buf, sizeof(Header));
+  size -= sizeof(Header);
+  if (size) {
+    if (!task->ParseFromArray(buf + sizeof(Header), size)) return false;
+  } else {
+    task->Clear();
+  }
+  Restore(head, task);
+  return true;
+}
+
+bool WireFormat::Extract(Task* task, Header* head) {
+  if (task->control() || task->value_type_size() > kMaxValueType) return false;
+  memset(head, 0, sizeof(Header));
+  head->magic = kMagic;
+
+  uint16 flags = 0;
+  if (task->request()) flags |= REQUEST;
+  task->clear_request();
+  if (task->has_customer_id()) {
+    flags |= HAS_CUSTOMER_ID;
+    head->customer_id = task->customer_id();
+    task->clear_customer_id();
+  }
+  if (task->has_time()) {
+    flags |= HAS_TIME;
+    head->time = task->time();
+    task->clear_time();
+  }
+  if (task->has_key_channel()) {
+    flags |= HAS_KEY_CHANNEL;
+    head->key_channel = task->key_channel();
+    task->clear_key_channel();
+  }
+  if (task->has_key_range()) {
+    const auto& kr = task->key_range();
+    // PbRange has only begin and end
+    flags |= HAS_KEY_RANGE;
+    head->key_begin = kr.begin();
+    head->key_end = kr.end();
+    task->clear_key_range();
+  }
+  if (task->has_key()) flags |= HAS_KEY;
+  task->clear_has_key();
+  if (task->has_key_type()) {
+    flags |= HAS_KEY_TYPE;
+    head->key_type = task->key_type();
+    task->clear_key_type();
+  }
+  head->num_value_type = task->value_type_size();
+  for (int i = 0; i < task->value_type_size(); ++i) {
+    head->value_type[i] = task->value_type(i);
+  }
+  task->clear_value_type();
+  if (task->has_priority()) {
+    flags |= HAS_PRIORITY;
+    head->priority = task->priority();
+    task->clear_priority();
+  }
+  if (task->has_param()) {
+    const auto& param = task->param();
+    if (param.has_push() && param.ByteSize() == 2) {
+      // a push or pull without other arguments
+      flags |= HAS_PUSH;
+      if (param.push()) flags |= PUSH;
+      task->clear_param();
+    }
+  }
+  head->flags = flags;
+  return true;
+}
+
+void WireFormat::Restore(const Header& head, Task* task) {
+  uint16 flags = head.flags;
+  if (flags & REQUEST) task->set_request(true);
+  if (flags & HAS_CUSTOMER_ID) task->set_customer_id(head.customer_id);
+  if (flags & HAS_TIME) task->set_time(head.time);
+  if (flags & HAS_KEY_CHANNEL) task->set_key_channel(head.key_channel);
+  if (flags & HAS_KEY_RANGE) {
+    auto kr = task->mutable_key_range();
+    kr->set_begin(head.key_begin);
+    kr->set_end(head.key_end);
+  }
+  if (flags & HAS_KEY) task->set_has_key(true);
+  if (flags & HAS_KEY_TYPE) task->set_key_type((DataType)head.key_type);
+  for (int i = 0; i < head.num_value_type; ++i) {
+    task->add_value_type((DataType)head.value_type[i]);
+  }
+  if (flags & HAS_PRIORITY) task->set_priority(head.priority);
+  if (flags & HAS_PUSH) task->mutable_param()->set_push(flags & PUSH);
+}
+
+} // namespace PS
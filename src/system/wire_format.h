@@ -0,0 +1,99 @@
+#pragma once
+#include "util/common.h"
+#include "util/shared_array.h"
+#include "system/proto/task.pb.h"
+namespace PS {
+
+/**
+ * @brief Encodes a task into the bytes sent by Van.
+ *
+ * The fields used by every push and pull, such as the customer id, the
+ * timestamp, the key channel and range, and the data types, are written into a
+ * fixed-layout binary header. All other fields, which are rare on the data
+ * path, follow the header as a serialized protobuf, which is empty for a plain
+ * push or pull. Control tasks are serialized by protobuf entirely.
+ *
+ * The first byte of the header is 0xFF, which never starts a serialized Task,
+ * so a receiver accepts both formats. Buffers of small encoded tasks are
+ * pooled.
+ */
+class WireFormat {
+ public:
+  WireFormat() : pool_(new Pool()) { }
+  ~WireFormat() { }
+
+  /**
+   * @brief Encodes "task". It is modified during encoding, but is restored
+   * before returning. Thread safe.
+   */
+  SArray<char> Encode(Task* task);
+
+  /**
+   * @brief Decodes "task" from "size" bytes in "buf"
+   */
+  bool Decode(const char* buf, size_t size, Task* task);
+
+ private:
+  static const uint8 kMagic = 0xFF;
+  static const int kMaxValueType = 5;
+
+  enum Flag {
+    REQUEST          = 1,
+    HAS_CUSTOMER_ID  = 1 << 1,
+    HAS_TIME         = 1 << 2,
+    HAS_KEY_CHANNEL  = 1 << 3,
+    HAS_KEY_RANGE    = 1 << 4,
+    HAS_KEY          = 1 << 5,
+    HAS_KEY_TYPE     = 1 << 6,
+    HAS_PRIORITY     = 1 << 7,
+    HAS_PUSH         = 1 << 8,  // param has and only has "push"
+    PUSH             = 1 << 9,
+  };
+
+  struct Header {
+    uint8 magic;
+    uint8 key_type;
+    uint8 num_value_type;
+    uint8 value_type[kMaxValueType];
+    uint16 flags;
+    uint16 reserved;
+    int32 priority;
+    int32 customer_id;
+    int32 time;
+    int32 key_channel;
+    int32 reserved2;
+    uint64 key_begin;
+    uint64 key_end;
+  };
+
+  // moves the hot fields from "task" into "head". returns false if "task"
+  // cannot be encoded by the header
+  bool Extract(Task* task, Header* head);
+  // sets the hot fields in "head" into "task"
+  void Restore(const Header& head, Task* task);
+
+  // returns a buffer with "size" bytes
+  SArray<char> Alloc(size_t size);
+
+  // the free buffers
+  struct Pool {
+    ~Pool() { for (char* p : free) delete [] p; }
+    void Put(char* p) {
+      {
+        Lock l(mu);
+        if (free.size() < kMaxFree) { free.push_back(p); return; }
+      }
+      delete [] p;
+    }
+    static const size_t kMaxFree = 4096;
+    std::vector<char*> free;
+    std::mutex mu;
+  };
+  static const size_t kBufSize = 256;
+  // shared with the buffers which may be released after me
+  std::shared_ptr<Pool> pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(WireFormat);
+};
+
+} // namespace PS
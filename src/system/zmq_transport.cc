@@ -0,0 +1,248 @@
+#include "system/zmq_transport.h"
+#include <string.h>
+namespace PS {
+
+DECLARE_bool(local);
+DECLARE_int32(bind_to);
+DECLARE_int32(num_io_threads);
+DECLARE_int32(socket_buffer);
+
+ZmqTransport::ZmqTransport() {
+  context_ = zmq_ctx_new();
+  CHECK(context_ != NULL) << "create 0mq context failed";
+
+  // one need to "sudo ulimit -n 65536" or edit /etc/security/limits.conf
+  zmq_ctx_set(context_, ZMQ_MAX_SOCKETS, 65536);
+  if (FLAGS_num_io_threads > 1) {
+    zmq_ctx_set(context_, ZMQ_IO_THREADS, FLAGS_num_io_threads);
+  }
+}
+
+ZmqTransport::~ZmqTransport() {
+  for (auto& it : senders_) zmq_close(it.second);
+  zmq_close(receiver_);
+  zmq_ctx_destroy(context_);
+}
+
+void ZmqTransport::Bind(const Node& my_node) {
+  receiver_ = zmq_socket(context_, ZMQ_ROUTER);
+  CHECK(receiver_ != NULL)
+      << "create receiver socket failed: " << zmq_strerror(errno);
+  if (FLAGS_socket_buffer > 0) {
+    int buf = FLAGS_socket_buffer << 10;
+    zmq_setsockopt(receiver_, ZMQ_RCVBUF, &buf, sizeof(buf));
+  }
+  string addr = "tcp://*:";
+  if (FLAGS_bind_to) {
+    addr += std::to_string(FLAGS_bind_to);
+  } else {
+    CHECK(my_node.has_port()) << my_node.ShortDebugString();
+    addr += std::to_string(my_node.port());
+  }
+  if (FLAGS_local) {
+    addr = "ipc:///tmp/" + my_node.id();
+  }
+  CHECK(zmq_bind(receiver_, addr.c_str()) == 0)
+      << "bind to " << addr << " failed: " << zmq_strerror(errno);
+
+  VLOG(1) << "BIND address " << addr;
+}
+
+void ZmqTransport::Disconnect(const NodeID& id) {
+  Lock l(senders_mu_);
+  if (senders_.find(id) != senders_.end()) {
+    zmq_close (senders_[id]);
+  }
+  senders_.erase(id);
+}
+
+bool ZmqTransport::Connect(const Node& my_node, const Node& node) {
+  NodeID id = node.id();
+  Lock l(senders_mu_);
+  if (senders_.find(id) != senders_.end()) {
+    return true;
+  }
+  void *sender = zmq_socket(context_, ZMQ_DEALER);
+  CHECK(sender != NULL) << zmq_strerror(errno);
+  string my_id = my_node.id(); // address(my_node_);
+  zmq_setsockopt (sender, ZMQ_IDENTITY, my_id.data(), my_id.size());
+  if (FLAGS_socket_buffer > 0) {
+    int buf = FLAGS_socket_buffer << 10;
+    zmq_setsockopt(sender, ZMQ_SNDBUF, &buf, sizeof(buf));
+  }
+
+  // uint64_t hwm = 5000000;
+  // zmq_setsockopt (sender, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+
+  // connect
+  string addr = "tcp://" + node.hostname() + ":" + std::to_string(node.port());
+  if (FLAGS_local) {
+    addr = "ipc:///tmp/" + node.id();
+  }
+  if (zmq_connect(sender, addr.c_str()) != 0) {
+    LOG(WARNING) << "connect to " + addr + " failed: " + zmq_strerror(errno);
+    return false;
+  }
+
+  senders_[id] = sender;
+  VLOG(1) << "CONNECT to " << id << " [" << addr << "]";
+  return true;
+}
+
+bool ZmqTransport::Send(
+    const NodeID& id, const std::vector<SArray<char>>& frames) {
+  // find the socket
+  void *socket = nullptr;
+  {
+    Lock l(senders_mu_);
+    auto it = senders_.find(id);
+    if (it == senders_.end()) {
+      LOG(WARNING) << "there is no socket to node " + id;
+      return false;
+    }
+    socket = it->second;
+  }
+
+  int n = frames.size();
+  for (int i = 0; i < n; ++i) {
+    // zero-copy, zmq holds a reference until the frame is sent
+    SArray<char>* data = new SArray<char>(frames[i]);
+    zmq_msg_t data_msg;
+    zmq_msg_init_data(&data_msg, data->data(), data->size(), FreeData, data);
+    int tag = i == n - 1 ? 0 : ZMQ_SNDMORE;
+    while (true) {
+      if (zmq_msg_send(&data_msg, socket, tag) == data->size()) break;
+      if (errno == EINTR) continue;  // may be interupted by profiler
+      LOG(WARNING) << "failed to send message to node [" << id
+                   << "] errno: " << zmq_strerror(errno);
+      // the message is still owned by me, and closing it frees "data"
+      zmq_msg_close(&data_msg);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ZmqTransport::Recv(NodeID* sender, std::vector<SArray<char>>* frames) {
+  frames->clear();
+  for (int i = 0; ; ++i) {
+    zmq_msg_t* zmsg = zmsg_pool_->Get();
+    CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
+    while (true) {
+      if (zmq_msg_recv(zmsg, receiver_, 0) != -1) break;
+      if (errno == EINTR) continue;  // may be interupted by google profiler
+      LOG(WARNING) << "failed to receive message. errno: "
+                   << zmq_strerror(errno);
+      zmq_msg_close(zmsg);
+      zmsg_pool_->Put(zmsg);
+      return false;
+    }
+    char* buf = CHECK_NOTNULL((char *)zmq_msg_data(zmsg));
+    size_t size = zmq_msg_size(zmsg);
+    bool more = zmq_msg_more(zmsg);
+
+    if (i == 0) {
+      // identify
+      *sender = std::string(buf, size);
+      zmq_msg_close(zmsg);
+      zmsg_pool_->Put(zmsg);
+      if (monitor_incoming_) WatchSender(*sender);
+    } else {
+      // ugly zero-copy
+      SArray<char> data(buf, size, false);
+      auto pool = zmsg_pool_;
+      data.pointer().reset(buf, [zmsg, pool](char*) {
+          zmq_msg_close(zmsg);
+          pool->Put(zmsg);
+        });
+      frames->push_back(data);
+    }
+
+    if (!more) { CHECK_GT(i, 0); break; }
+  }
+  return true;
+}
+
+void ZmqTransport::WatchSender(const NodeID& sender) {
+  {
+    Lock l(fd_to_nodeid_mu_);
+    if (nodeid_to_fd_.count(sender)) return;
+  }
+  // it is the first time receiving a message from the sender on its current
+  // connection. store the file desciptor of the sender for the monitor
+  int val[64]; size_t val_len = sender.size();
+  CHECK_LT(val_len, 64*sizeof(int));
+  memcpy(val, sender.data(), val_len);
+  CHECK(!zmq_getsockopt(
+      receiver_,  ZMQ_IDENTITY_FD, (char*)val, &val_len))
+      << "failed to get the file descriptor of " << sender;
+  CHECK_EQ(val_len, 4);
+  int fd = val[0];
+  VLOG(1) << "node [" << sender << "] is on file descriptor " << fd;
+  Lock l(fd_to_nodeid_mu_);
+  fd_to_nodeid_[fd] = sender;
+  nodeid_to_fd_[sender] = fd;
+}
+
+void ZmqTransport::Monitor(const NodeID& id, const DisconnectHandler& handler) {
+  disconnect_handler_ = handler;
+  monitor_id_ = id;
+  if (id.empty()) {
+    monitor_incoming_ = true;
+    CHECK(!zmq_socket_monitor(receiver_, "inproc://monitor", ZMQ_EVENT_ALL));
+  } else {
+    Lock l(senders_mu_);
+    CHECK(senders_.count(id)) << "not connected to " << id;
+    CHECK(!zmq_socket_monitor(
+        senders_[id], "inproc://monitor", ZMQ_EVENT_ALL));
+  }
+  monitor_thread_ = new std::thread(&ZmqTransport::MonitorThread, this);
+  monitor_thread_->detach();
+}
+
+void ZmqTransport::MonitorThread() {
+  VLOG(1) << "starting monitor...";
+  void *s = CHECK_NOTNULL(zmq_socket (context_, ZMQ_PAIR));
+  CHECK(!zmq_connect (s, "inproc://monitor"));
+  while (true) {
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    if (zmq_msg_recv(&msg, s, 0) == -1) {
+      if (errno == EINTR) continue;  // may be interupted by google profiler
+      break;
+    }
+    uint8_t *data = (uint8_t *)zmq_msg_data (&msg);
+    int event = *(uint16_t *)(data);
+    int value = *(uint32_t *)(data + 2);
+
+    if (event == ZMQ_EVENT_DISCONNECTED) {
+      if (monitor_incoming_) {
+        NodeID id;
+        {
+          Lock l(fd_to_nodeid_mu_);
+          auto it = fd_to_nodeid_.find(value);
+          if (it == fd_to_nodeid_.end()) {
+            LOG(WARNING) << "cannot find the node id for FD = " << value;
+            continue;
+          }
+          id = it->second;
+          // the connection is closed. a node with the same id reconnecting,
+          // such as a replacement, is watched again
+          fd_to_nodeid_.erase(it);
+          auto jt = nodeid_to_fd_.find(id);
+          if (jt != nodeid_to_fd_.end() && jt->second == value) {
+            nodeid_to_fd_.erase(jt);
+          }
+        }
+        disconnect_handler_(id);
+      } else {
+        disconnect_handler_(monitor_id_);
+      }
+    }
+    if (event == ZMQ_EVENT_MONITOR_STOPPED) break;
+  }
+  zmq_close (s);
+  VLOG(1) << "monitor stopped.";
+}
+
+} // namespace PS
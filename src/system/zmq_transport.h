@@ -0,0 +1,55 @@
+#pragma once
+#include "system/transport.h"
+#include "util/object_pool.h"
+#include <zmq.h>
+namespace PS {
+
+/**
+ * @brief The transport based on ZeroMQ. A node receives messages on a ROUTER
+ * socket, and sends messages through a DEALER socket per remote node.
+ */
+class ZmqTransport : public Transport {
+ public:
+  ZmqTransport();
+  virtual ~ZmqTransport();
+
+  virtual void Bind(const Node& my_node);
+  virtual bool Connect(const Node& my_node, const Node& node);
+  virtual void Disconnect(const NodeID& id);
+  virtual bool Send(const NodeID& id, const std::vector<SArray<char>>& frames);
+  virtual bool Recv(NodeID* sender, std::vector<SArray<char>>* frames);
+  virtual void Monitor(const NodeID& id, const DisconnectHandler& handler);
+
+ private:
+  static void FreeData(void *data, void *hint) {
+    delete (SArray<char>*)hint;
+  }
+
+  // stores the file descriptor of the connection from "sender"
+  void WatchSender(const NodeID& sender);
+  void MonitorThread();
+
+  // recycled zmq messages. shared with the received frames, which may be
+  // released after me
+  std::shared_ptr<ObjectPool<zmq_msg_t>> zmsg_pool_{new ObjectPool<zmq_msg_t>()};
+
+  void *context_ = nullptr;
+  void *receiver_ = nullptr;
+  std::unordered_map<NodeID, void *> senders_;
+  // protects senders_. a socket is only used by the thread sending to its node
+  std::mutex senders_mu_;
+
+  // for monitor
+  DisconnectHandler disconnect_handler_;
+  NodeID monitor_id_;
+  bool monitor_incoming_ = false;
+  // the connections from the watched senders, which are dropped once closed
+  std::unordered_map<int, NodeID> fd_to_nodeid_;
+  std::unordered_map<NodeID, int> nodeid_to_fd_;
+  std::mutex fd_to_nodeid_mu_;
+  std::thread* monitor_thread_ = nullptr;
+
+  DISALLOW_COPY_AND_ASSIGN(ZmqTransport);
+};
+
+} // namespace PS
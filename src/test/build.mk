@@ -9,6 +9,10 @@ build/kv_layer_ps \
 build/kv_layer_perf_ps \
 build/assign_op_test \
 build/parallel_ordered_match_test \
+build/sharded_hash_map_test \
+build/checkpoint_test \
+build/sgd_kernel_test \
+build/kv_layer_layout_test \
 build/common_test
 
 build/%_ps: src/test/%_ps.cc $(PS_LIB)
@@ -18,6 +22,9 @@ build/%_ps: src/test/%_ps.cc $(PS_LIB)
 TESTFLAGS = $(TEST_MAIN) -lgtest $(LDFLAGS)
 
 build/parallel_ordered_match_test: build/util/file.o build/util/proto/*.o build/data/proto/*.pb.o
+build/checkpoint_test: build/util/file.o build/util/proto/*.o build/data/proto/*.pb.o
+build/sgd_kernel_test: build/app/linear_method/proto/linear.pb.o $(PS_LIB)
+build/kv_layer_layout_test: $(PS_LIB)
 
 build/%_test: build/test/%_test.o
 	$(CC) $(CFLAGS) $(filter %.o %.a %.cc, $^) $(TESTFLAGS) -o $@
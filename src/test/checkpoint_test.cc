@@ -0,0 +1,115 @@
+#include "gtest/gtest.h"
+#include "parameter/model_store.h"
+#include "util/shared_array_inl.h"
+
+using namespace PS;
+namespace PS {
+DEFINE_int32(num_threads, 2, "");
+}  // namespace PS
+
+TEST(Checkpoint, WriteRead) {
+  // a sparse segment with 2 values per key, and a dense one
+  int n = 100000, k = 2;
+  SArray<uint64> key(n);
+  SArray<float> val(n * k);
+  srand(0);
+  for (int i = 0; i < n; ++i) {
+    key[i] = ((uint64)rand() << 32) | i;
+    val[i * k] = i; val[i * k + 1] = -i;
+  }
+  SortKeyValue(&key, &val, k);
+  for (int i = 1; i < n; ++i) ASSERT_LT(key[i-1], key[i]);
+  SArray<float> layer(5000);
+  for (size_t i = 0; i < layer.size(); ++i) layer[i] = i * .5;
+
+  std::string file = "/tmp/checkpoint_test";
+  CheckpointWriter<uint64, float> writer;
+  writer.Add(3, key, val, k);
+  writer.Add(7, SArray<uint64>(), layer, 1);
+  ASSERT_TRUE(writer.Write(file));
+
+  CheckpointReader<uint64, float> reader;
+  ASSERT_TRUE(reader.Open(file));
+  ASSERT_EQ(reader.num_segments(), 2);
+
+  const auto& s0 = reader.segment(0);
+  EXPECT_EQ(s0.channel, 3);
+  EXPECT_EQ(s0.k, k);
+  ASSERT_EQ(s0.n, (size_t)n);
+  for (int i = 0; i < n; ++i) {
+    ASSERT_EQ(s0.key[i], key[i]);
+    size_t p = s0.Find(key[i]);
+    ASSERT_EQ(p, (size_t)i);
+    EXPECT_EQ(s0.value[p * k], val[i * k]);
+    EXPECT_EQ(s0.value[p * k + 1], val[i * k + 1]);
+    // the low 32 bits are unique, so key + 1 is not a key unless it is the next
+    if (i + 1 < n && key[i] + 1 != key[i + 1]) {
+      EXPECT_EQ(s0.Find(key[i] + 1), (size_t)-1);
+    }
+  }
+  EXPECT_EQ(s0.Find(0), (size_t)-1);
+
+  const auto& s1 = reader.segment(1);
+  EXPECT_EQ(s1.channel, 7);
+  EXPECT_TRUE(s1.key == nullptr);
+  ASSERT_EQ(s1.n, layer.size());
+  for (size_t i = 0; i < layer.size(); ++i) {
+    EXPECT_EQ(s1.Find(i), i);
+    EXPECT_EQ(s1.value[i], layer[i]);
+  }
+  EXPECT_EQ(s1.Find(layer.size()), (size_t)-1);
+
+  // a checkpoint with another value type
+  CheckpointReader<uint64, double> bad;
+  EXPECT_FALSE(bad.Open(file));
+}
+
+TEST(ModelStore, Get) {
+  // a model saved by two servers
+  int n = 200000;
+  std::map<uint64, float> ref;
+  srand(1);
+  for (int s = 0; s < 2; ++s) {
+    SArray<uint64> key;
+    SArray<float> val;
+    for (int i = 0; i < n; ++i) {
+      // unique and disjoint keys
+      uint64 k = (uint64)i * 1000003 % 2147483647 * 2 + s;
+      float v = i % 5 == 0 ? 0 : rand() % 1000;
+      key.push_back(k);
+      val.push_back(v);
+      val.push_back(-1);
+    }
+    SortKeyValue(&key, &val, 2);
+    for (size_t i = 0; i < key.size(); ++i) ref[key[i]] = val[i * 2];
+    CheckpointWriter<uint64, float> writer;
+    writer.Add(0, key, val, 2);
+    ASSERT_TRUE(writer.Write("/tmp/model_store_test_" + std::to_string(s)));
+  }
+
+  ModelStore<uint64, float> store;
+  for (int s = 0; s < 2; ++s) {
+    ASSERT_TRUE(store.AddCheckpoint("/tmp/model_store_test_" + std::to_string(s)));
+  }
+  store.Build();
+  size_t nnz = 0;
+  for (const auto& it : ref) nnz += it.second != 0;
+  EXPECT_EQ(store.size(), nnz);
+
+  // existing keys, and their neighbors which are mostly missing
+  SArray<uint64> query;
+  for (const auto& it : ref) {
+    query.push_back(it.first);
+    query.push_back(it.first + 2);
+  }
+  query.push_back(0);
+  query.push_back(kuint64max);
+  SArray<float> val(query.size());
+  store.Get(query.data(), query.size(), val.data(), -1);
+  for (size_t i = 0; i < query.size(); ++i) {
+    auto it = ref.find(query[i]);
+    float expect = (it == ref.end() || it->second == 0) ? -1 : it->second;
+    ASSERT_EQ(val[i], expect) << query[i];
+  }
+  EXPECT_EQ(store.Get(query[0], -1), val[0]);
+}
@@ -0,0 +1,77 @@
+#include "gtest/gtest.h"
+#include "parameter/kv_layer.h"
+
+using namespace PS;
+
+// checks the layout of "sizes" planned for n servers
+void Check(const std::vector<std::pair<int, size_t>>& sizes, size_t thr, int n) {
+  auto layouts = PlanLayerLayout(sizes, thr, n);
+  ASSERT_EQ(layouts.size(), sizes.size());
+  std::vector<size_t> load(n, 0);
+  size_t total = 0, max_part = 0;
+  for (const auto& l : sizes) {
+    const auto& layout = layouts[l.first];
+    ASSERT_EQ(layout.size(), (size_t)n);
+    // the non-empty parts cover the layer without overlap, in the order of
+    // the servers
+    Key end = 0;
+    int parts = 0;
+    for (int i = 0; i < n; ++i) {
+      const auto& r = layout[i];
+      if (r.empty()) continue;
+      EXPECT_EQ(r.begin(), end) << "layer " << l.first;
+      end = r.end();
+      ++ parts;
+      // a part is smaller than the threshold only if it is the whole layer
+      if (r.size() != l.second) EXPECT_GE(r.size(), thr);
+      load[i] += r.size();
+      max_part = std::max(max_part, (size_t)r.size());
+    }
+    EXPECT_EQ(end, l.second) << "layer " << l.first;
+    EXPECT_LE(parts, n);
+    total += l.second;
+  }
+  // the parts are placed on the least loaded servers from the largest layer
+  // on, so the most loaded server exceeds the average by at most one part
+  size_t max_load = *std::max_element(load.begin(), load.end());
+  EXPECT_LE(max_load, (total + n - 1) / n + max_part);
+
+  // another worker gets the same layout, even if the sizes are in another
+  // order
+  auto reversed = sizes;
+  std::reverse(reversed.begin(), reversed.end());
+  auto layouts2 = PlanLayerLayout(reversed, thr, n);
+  for (const auto& l : sizes) {
+    EXPECT_EQ(layouts[l.first], layouts2[l.first]) << "layer " << l.first;
+  }
+}
+
+TEST(KVLayer, PlanLayout) {
+  // the layers of a neural network, such as weights and biases
+  std::vector<std::pair<int, size_t>> sizes;
+  for (int i = 0; i < 10; ++i) {
+    sizes.push_back(std::make_pair(2 * i, (size_t)(i + 1) * 100003));
+    sizes.push_back(std::make_pair(2 * i + 1, (size_t)(i + 1) * 7));
+  }
+  for (int n : {1, 2, 3, 8, 32}) Check(sizes, 1000, n);
+  // layers with the same size
+  std::vector<std::pair<int, size_t>> same;
+  for (int i = 0; i < 17; ++i) same.push_back(std::make_pair(i, (size_t)5000));
+  for (int n : {1, 4, 7}) Check(same, 1000, n);
+}
+
+TEST(KVLayer, PlanTinyLayers) {
+  // each layer is smaller than the threshold, so it goes to a single server
+  std::vector<std::pair<int, size_t>> sizes;
+  srand(0);
+  for (int i = 0; i < 100; ++i) {
+    sizes.push_back(std::make_pair(i, (size_t)(rand() % 999 + 1)));
+  }
+  Check(sizes, 1000, 5);
+  auto layouts = PlanLayerLayout(sizes, 1000, 5);
+  for (const auto& l : sizes) {
+    int parts = 0;
+    for (const auto& r : layouts[l.first]) parts += !r.empty();
+    EXPECT_EQ(parts, 1);
+  }
+}
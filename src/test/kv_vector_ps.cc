@@ -54,6 +54,15 @@ class Worker : public App {
     vec_.Wait(ts2);
     std::cout << MyNodeID() << ": pulled value in channel 1 " << vec_[1].value
               << std::endl;
+
+    // requests on an empty key range are sent to no server, their futures are
+    // finished without responses
+    auto none = Parameter::Request(
+        2, Message::kInvalidTime, {}, Parameter::Filters(), Range<Key>(0, 0));
+    vec_.PushAsync(none, SArray<K>(), {SArray<V>()}).Wait();
+    vec_.PullAsync(none, SArray<K>()).Wait();
+    std::cout << MyNodeID() << ": finished the requests sent to no server"
+              << std::endl;
   }
  private:
   KVVector<K, V> vec_;
@@ -1,6 +1,7 @@
 #include "gtest/gtest.h"
 #include "util/parallel_ordered_match.h"
 #include "util/shared_array_inl.h"
+#include "util/resource_usage.h"
 
 using namespace PS;
 namespace PS {
@@ -33,3 +34,128 @@ TEST_F(PMatchTest, match) {
 
   LL << n << " " << val2;
 }
+
+// the previous implementation, which starts a thread per half and uses a
+// runtime assign op
+template <typename K, typename V>
+void ThreadedOrderedMatch(
+    const K* src_key, const K* src_key_end, const V* src_val,
+    const K* dst_key, const K* dst_key_end, V* dst_val,
+    int k, AssignOpType op, size_t grainsize, size_t* n) {
+  size_t src_len = std::distance(src_key, src_key_end);
+  size_t dst_len = std::distance(dst_key, dst_key_end);
+  if (dst_len == 0 || src_len == 0) return;
+
+  src_key = std::lower_bound(src_key, src_key_end, *dst_key);
+  src_val += (src_key - (src_key_end - src_len)) * k;
+
+  if (dst_len <= grainsize) {
+    while (dst_key != dst_key_end && src_key != src_key_end) {
+      if (*src_key < *dst_key) {
+        ++ src_key; src_val += k;
+      } else {
+        if (!(*dst_key < *src_key)) {
+          for (int i = 0; i < k; ++i) {
+            AssignOp(dst_val[i], src_val[i], op);
+          }
+          ++ src_key; src_val += k;
+          *n += k;
+        }
+        ++ dst_key; dst_val += k;
+      }
+    }
+  } else {
+    std::thread thr(
+        ThreadedOrderedMatch<K,V>, src_key, src_key_end, src_val,
+        dst_key, dst_key + dst_len / 2, dst_val,
+        k, op, grainsize, n);
+    size_t m = 0;
+    ThreadedOrderedMatch<K,V>(
+        src_key, src_key_end, src_val,
+        dst_key + dst_len / 2, dst_key_end, dst_val + ( dst_len / 2 ) * k,
+        k, op, grainsize, &m);
+    thr.join();
+    *n += m;
+  }
+}
+
+// returns "n" random ordered keys in [0, max_key)
+SArray<uint64> RandomKeys(size_t n, uint64 max_key) {
+  SArray<uint64> key(n);
+  for (size_t i = 0; i < n; ++i) key[i] = ((uint64)rand() * RAND_MAX + rand()) % max_key;
+  std::sort(key.begin(), key.end());
+  key.resize(std::unique(key.begin(), key.end()) - key.begin());
+  return key;
+}
+
+void Bench(size_t src_len, size_t dst_len) {
+  int k = FLAGS_k;
+  uint64 max_key = std::max(src_len, dst_len) * 4;
+  auto src_key = RandomKeys(src_len, max_key);
+  auto dst_key = RandomKeys(dst_len, max_key);
+  SArray<double> src_val(src_key.size() * k);
+  for (size_t i = 0; i < src_val.size(); ++i) src_val[i] = i;
+
+  SArray<double> v1(dst_key.size() * k, 0), v2(dst_key.size() * k, 0);
+  SizeR range = dst_key.FindRange(src_key.range());
+  size_t grainsize = std::max(
+      range.size() * k / FLAGS_num_threads + 5, (size_t)1024*1024);
+  auto tv = tic();
+  size_t n1 = 0;
+  ThreadedOrderedMatch<uint64, double>(
+      src_key.begin(), src_key.end(), src_val.begin(),
+      dst_key.begin() + range.begin(), dst_key.begin() + range.end(),
+      v1.begin() + range.begin() * k, k, AssignOpType::PLUS, grainsize, &n1);
+  double t1 = toc(tv);
+
+  tv = tic();
+  size_t n2 = ParallelOrderedMatch(
+      src_key, src_val, dst_key, &v2, k, AssignOpType::PLUS);
+  double t2 = toc(tv);
+
+  LOG(INFO) << "src " << src_key.size() << ", dst " << dst_key.size()
+            << ": threaded " << t1 << " sec, pooled " << t2 << " sec";
+  EXPECT_EQ(n1, n2);
+  EXPECT_EQ(v1, v2);
+}
+
+TEST(PMatchBench, Balanced) {
+  Bench(10000000, 10000000);
+}
+
+TEST(PMatchBench, LargeSrc) {
+  Bench(20000000, 100000);
+}
+
+// a sparse pull against a huge server key set
+TEST(PMatchBench, SparsePull) {
+  Bench(20000000, 1000);
+}
+
+TEST(PMatchBench, LargeDst) {
+  Bench(100000, 20000000);
+}
+
+TEST(PMatchBench, Small) {
+  Bench(100000, 100000);
+}
+
+// keys above 2^53, which are not exact as doubles
+TEST(PMatch, SearchLargeKeys) {
+  std::vector<uint64> keys;
+  for (uint64 i = 0; i < 1000; ++i) keys.push_back(kuint64max - 3000 + i * 3);
+  for (uint64 i = 0; i < 1000; ++i) keys.push_back(kuint64max - 2 + i % 2);
+  std::sort(keys.begin(), keys.end());
+  for (uint64 key = kuint64max - 3100; key != 0; ++key) {
+    size_t expect = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+    ASSERT_EQ(Search(keys.data(), 0, keys.size(), key), expect) << key;
+    ASSERT_EQ(Gallop(keys.data(), 0, keys.size(), key), expect) << key;
+  }
+  std::vector<int64> skeys;
+  for (int64 i = -500; i < 500; ++i) skeys.push_back(i * (kint64max / 500));
+  for (int64 i = -500; i < 500; ++i) {
+    int64 key = i * (kint64max / 500) + 1;
+    size_t expect = std::lower_bound(skeys.begin(), skeys.end(), key) - skeys.begin();
+    ASSERT_EQ(Search(skeys.data(), 0, skeys.size(), key), expect) << key;
+  }
+}
@@ -0,0 +1,113 @@
+#include "gtest/gtest.h"
+#include "app/linear_method/sgd_kernel.h"
+#include "app/linear_method/learning_rate.h"
+#include "app/linear_method/penalty.h"
+
+using namespace PS;
+using namespace PS::LM;
+
+// the entries updated one by one, as the async SGD server did before the
+// batched kernel
+template <typename V> struct FTRLEntry {
+  V w = 0, z = 0, sqrt_n = 0;
+  void Set(V grad, LearningRate<V>* lr, Penalty<V>* h) {
+    V sqrt_n_new = sqrt(sqrt_n * sqrt_n + grad * grad);
+    V sigma = (sqrt_n_new - sqrt_n) / lr->alpha();
+    z += grad  - sigma * w;
+    sqrt_n = sqrt_n_new;
+    V eta = lr->eval(sqrt_n);
+    w = h->proximal(-z*eta, eta);
+  }
+};
+
+template <typename V> struct AdaGradEntry {
+  V weight = 0, sum_sq_grad = 0;
+  void Set(V grad, LearningRate<V>* lr, Penalty<V>* h) {
+    sum_sq_grad += grad * grad;
+    V eta = lr->eval(sqrt(sum_sq_grad));
+    weight = h->proximal(weight - eta * grad, eta);
+  }
+};
+
+// the scalar and AVX2 versions give the same results, while the compiler may
+// fuse the multiply-adds of the AVX-512 one, whose rounding differences
+// accumulate in z and n
+template <typename V>
+void Near(int isa, V expect, V actual) {
+  if (isa < 2) {
+    EXPECT_EQ(expect, actual);
+  } else {
+    EXPECT_NEAR(expect, actual, 1e-4 * (1 + fabs(expect)));
+  }
+}
+
+// runs the kernel with the scalar, AVX2 and AVX-512 versions on random sparse
+// gradients, the FTRL entries are stored in an EntryArray, and the AdaGrad ones
+// in plain arrays
+void Check(LearningRateConfig::Type type, PenaltyConfig::Type penalty) {
+  LearningRateConfig lr_conf;
+  lr_conf.set_type(type);
+  lr_conf.set_alpha(.1);
+  lr_conf.set_beta(1);
+  PenaltyConfig h_conf;
+  h_conf.set_type(penalty);
+  h_conf.add_lambda(.05);
+  h_conf.add_lambda(.01);
+  LearningRate<float> lr(lr_conf);
+  std::unique_ptr<Penalty<float>> h(createPenalty<float>(h_conf));
+
+  for (int isa = 0; isa < 3; ++isa) {
+    SGDKernel<float> kernel(lr_conf, h_conf);
+    kernel.set_isa(isa);
+    if (kernel.isa() != isa) {
+      LOG(WARNING) << "the CPU does not support version " << isa;
+      continue;
+    }
+    // not a multiple of the vector width
+    size_t n = 1003;
+    EntryArray<float> w, z, sqrt_n;
+    w.Reserve(n); z.Reserve(n); sqrt_n.Reserve(n);
+    std::vector<float> w2(n), sum_sq_grad(n);
+    std::vector<FTRLEntry<float>> ftrl(n);
+    std::vector<AdaGradEntry<float>> adagrad(n);
+
+    srand(isa);
+    for (int it = 0; it < 50; ++it) {
+      std::vector<uint32> pos;
+      std::vector<float> grad;
+      for (size_t i = 0; i < n; ++i) {
+        if (rand() % 4 == 0) continue;
+        pos.push_back(i);
+        grad.push_back((rand() % 2001 - 1000) / 500.0);
+      }
+      SGDKernel<float>::Stat st, st2;
+      kernel.FTRL(pos.data(), grad.data(), pos.size(), w, z, sqrt_n, &st);
+      kernel.AdaGrad(pos.data(), grad.data(), pos.size(), w2.data(),
+                     sum_sq_grad.data(), &st2);
+      for (size_t i = 0; i < pos.size(); ++i) {
+        ftrl[pos[i]].Set(grad[i], &lr, h.get());
+        adagrad[pos[i]].Set(grad[i], &lr, h.get());
+      }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+      Near(isa, ftrl[i].w, w[i]);
+      Near(isa, ftrl[i].z, z[i]);
+      Near(isa, ftrl[i].sqrt_n, sqrt_n[i]);
+      Near(isa, adagrad[i].weight, w2[i]);
+      Near(isa, adagrad[i].sum_sq_grad, sum_sq_grad[i]);
+    }
+  }
+}
+
+TEST(SGDKernel, DecayL1) {
+  Check(LearningRateConfig::DECAY, PenaltyConfig::L1);
+}
+
+TEST(SGDKernel, ConstantL1) {
+  Check(LearningRateConfig::CONSTANT, PenaltyConfig::L1);
+}
+
+TEST(SGDKernel, DecayL2) {
+  Check(LearningRateConfig::DECAY, PenaltyConfig::L2);
+}
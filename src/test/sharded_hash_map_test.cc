@@ -0,0 +1,53 @@
+#include "gtest/gtest.h"
+#include "util/sharded_hash_map.h"
+#include "util/resource_usage.h"
+using namespace PS;
+
+TEST(ShardedHashMap, InsertFind) {
+  ShardedHashMap<uint64, int> map(8);
+  std::unordered_map<uint64, int> ref;
+  srand(0);
+  for (int i = 0; i < 100000; ++i) {
+    uint64 key = ((uint64)rand() << 32) | rand();
+    if (i % 3 == 0) key %= 1000;
+    map[key] += i;
+    ref[key] += i;
+  }
+  EXPECT_EQ(map.size(), ref.size());
+  for (const auto& it : ref) {
+    auto e = map.Find(it.first);
+    ASSERT_TRUE(e != nullptr);
+    EXPECT_EQ(*e, it.second);
+  }
+  EXPECT_TRUE(map.Find(1ULL << 63) == nullptr);
+
+  size_t n = 0;
+  map.ForEach([&n, &ref](uint64 key, int& v) { EXPECT_EQ(ref[key], v); ++ n; });
+  EXPECT_EQ(n, ref.size());
+}
+
+TEST(ShardedHashMap, Batch) {
+  int num_threads = 3;
+  ShardedHashMap<uint64, double> map(16);
+  std::vector<uint64> keys(1000000);
+  for (size_t i = 0; i < keys.size(); ++i) keys[i] = i * 7919;
+
+  // each thread inserts the keys in its own shards
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.push_back(std::thread([&map, &keys, t, num_threads]() {
+          map.Batch(keys.data(), keys.size(), [&keys](size_t i, double* e) {
+              *e = (double)keys[i]; }, t, num_threads);
+        }));
+  }
+  for (auto& t : threads) t.join();
+  EXPECT_EQ(map.size(), keys.size());
+
+  auto tv = tic();
+  double sum = 0, expect = 0;
+  map.Batch(keys.data(), keys.size(), [&sum](size_t i, double* e) {
+      sum += *e; });
+  LOG(INFO) << "batched lookup: " << keys.size() / toc(tv) << " keys/sec";
+  for (auto k : keys) expect += (double)k;
+  EXPECT_EQ(sum, expect);
+}
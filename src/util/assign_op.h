@@ -25,6 +25,26 @@ T& AssignOp(T& right, const T& left, const AssignOpType& op) {
   return right;
 }
 
+// Returns right op= left, where "op" is known at compile time
+template<AssignOpType op, typename T>
+inline T& AssignOp(T& right, const T& left) {
+  switch (op) {
+    case AssignOpType::ASSIGN:
+      right = left; break;
+    case AssignOpType::PLUS:
+      right += left; break;
+    case AssignOpType::MINUS:
+      right -= left; break;
+    case AssignOpType::TIMES:
+      right *= left; break;
+    case AssignOpType::DIVIDE:
+      right /= left; break;
+    default:
+      CHECK(false) << "use AssignOpI.." ;
+  }
+  return right;
+}
+
 // Returns right op= left. for integers
 template<typename T>
 T& AssignOpI(T& right, const T& left, const AssignOpType& op) {
@@ -0,0 +1,148 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <utility>
+#include "util/common.h"
+namespace PS {
+
+/**
+ * @brief The completion of an asynchronous operation, such as a request
+ * submitted by a customer.
+ *
+ * Unlike std::future, a continuation can be attached by Then, which is called
+ * by the thread finishing the operation, or immediately if it is already
+ * finished. So a thread can pipeline many operations without blocking on each
+ * of them.
+ *
+ * Sample usage:
+ *   model.PullAsync(req, key).Then([&]() {
+ *       return model.PushAsync(req2, key, {grad});
+ *     }).Wait();
+ *
+ * It is also an awaitable, namely "co_await future" in a C++20 coroutine.
+ */
+class Future {
+ public:
+  Future() : state_(std::make_shared<State>()) { }
+
+  /// @brief Returns the timestamp of the request, or -1 if it is not a request
+  int time() const { return time_; }
+
+  /// @brief Returns true if finished
+  bool Ready() const {
+    Lock l(state_->mu); return state_->done;
+  }
+
+  /// @brief Blocks until finished
+  void Wait() const {
+    std::unique_lock<std::mutex> lk(state_->mu);
+    state_->cond.wait(lk, [this]{ return state_->done; });
+  }
+
+  /**
+   * @brief Calls "func" once finished.
+   *
+   * @param func a function returns either void or a Future
+   *
+   * @return a future which is finished after "func" returns, or after the
+   * future returned by "func" is finished
+   */
+  template <typename F> Future Then(F func) {
+    return Then(func, typename std::is_same<
+                decltype(std::declval<F>()()), Future>::type());
+  }
+
+  /// @brief Returns a future finished once all of "futures" are finished
+  static Future WhenAll(const std::vector<Future>& futures) {
+    Future all;
+    auto remain = std::make_shared<std::atomic<size_t>>(futures.size() + 1);
+    auto state = all.state_;
+    auto fin = [remain, state]() { if (-- *remain == 0) Finish(state); };
+    for (const auto& f : futures) f.OnFinish(fin);
+    fin();
+    return all;
+  }
+
+  // the awaitable interface of C++20 coroutines
+  bool await_ready() const { return Ready(); }
+  template <typename Handle> void await_suspend(Handle h) const {
+    OnFinish([h]() mutable { h.resume(); });
+  }
+  void await_resume() const { }
+
+ private:
+  friend class Promise;
+  struct State {
+    std::mutex mu;
+    std::condition_variable cond;
+    bool done = false;
+    std::vector<std::function<void()>> continuations;
+  };
+
+  Future(const std::shared_ptr<State>& state, int time)
+      : state_(state), time_(time) { }
+
+  // runs "func" once finished
+  void OnFinish(const std::function<void()>& func) const {
+    {
+      Lock l(state_->mu);
+      if (!state_->done) {
+        state_->continuations.push_back(func);
+        return;
+      }
+    }
+    func();
+  }
+
+  static void Finish(const std::shared_ptr<State>& state) {
+    std::vector<std::function<void()>> continuations;
+    {
+      Lock l(state->mu);
+      if (state->done) return;
+      state->done = true;
+      continuations.swap(state->continuations);
+    }
+    state->cond.notify_all();
+    for (auto& func : continuations) func();
+  }
+
+  // "func" returns void
+  template <typename F> Future Then(F func, std::false_type) {
+    Future next;
+    auto state = next.state_;
+    OnFinish([func, state]() mutable { func(); Finish(state); });
+    return next;
+  }
+
+  // "func" returns a Future
+  template <typename F> Future Then(F func, std::true_type) {
+    Future next;
+    auto state = next.state_;
+    OnFinish([func, state]() mutable {
+        func().OnFinish([state]() { Finish(state); });
+      });
+    return next;
+  }
+
+  std::shared_ptr<State> state_;
+  int time_ = -1;
+};
+
+/**
+ * @brief Finishes a Future
+ */
+class Promise {
+ public:
+  Promise() : state_(std::make_shared<Future::State>()) { }
+
+  /// @brief Returns the future of request "time"
+  Future future(int time = -1) const { return Future(state_, time); }
+
+  /// @brief Marks the future as finished, and runs its continuations
+  void Finish() const { Future::Finish(state_); }
+
+ private:
+  std::shared_ptr<Future::State> state_;
+};
+
+} // namespace PS
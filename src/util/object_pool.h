@@ -0,0 +1,50 @@
+#pragma once
+#include "util/common.h"
+namespace PS {
+
+/**
+ * @brief A thread-safe pool of objects created by new, to save the memory
+ * allocation of frequently created objects.
+ *
+ * An object is not reset when put back, the caller should do it if necessary.
+ * At most "capacity" free objects are kept, the others are deleted.
+ */
+template <typename T> class ObjectPool {
+ public:
+  explicit ObjectPool(size_t capacity = 4096) : capacity_(capacity) { }
+  ~ObjectPool() { for (T* obj : free_) delete obj; }
+
+  /// @brief Returns a free object, or a new one if the pool is empty
+  T* Get() {
+    {
+      Lock l(mu_);
+      if (!free_.empty()) {
+        T* obj = free_.back();
+        free_.pop_back();
+        return obj;
+      }
+    }
+    return new T();
+  }
+
+  /// @brief Gives back "obj"
+  void Put(T* obj) {
+    if (obj == nullptr) return;
+    {
+      Lock l(mu_);
+      if (free_.size() < capacity_) {
+        free_.push_back(obj);
+        return;
+      }
+    }
+    delete obj;
+  }
+
+ private:
+  size_t capacity_;
+  std::vector<T*> free_;
+  std::mutex mu_;
+  DISALLOW_COPY_AND_ASSIGN(ObjectPool);
+};
+
+} // namespace PS
@@ -1,52 +1,163 @@
 #pragma once
 #include "util/shared_array.h"
 #include "util/assign_op.h"
+#include "util/parallel_pool.h"
 namespace PS {
 
-// the implementation, see comments bellow
-template <typename K, typename V>
-void ParallelOrderedMatch(
-    const K* src_key, const K* src_key_end, const V* src_val,
-    const K* dst_key, const K* dst_key_end, V* dst_val,
-    int k, AssignOpType op, size_t grainsize, size_t* n) {
-  size_t src_len = std::distance(src_key, src_key_end);
-  size_t dst_len = std::distance(dst_key, dst_key_end);
-  if (dst_len == 0 || src_len == 0) return;
+// Narrows [*begin, *end) containing the first position whose key is not less
+// than "key" by a few interpolation steps, which take O(log log n) for evenly
+// distributed keys. Returns true if the position is found and stored in *begin
+template <typename K>
+inline bool Interpolate(const K* keys, size_t* begin, size_t* end, K key,
+                        std::true_type /* integral */) {
+  typedef typename std::make_unsigned<K>::type U;
+  for (int t = 0; t < 4 && *end - *begin > 64; ++t) {
+    K lo = keys[*begin], hi = keys[*end - 1];
+    if (!(lo < key)) return true;
+    if (hi < key) { *begin = *end; return true; }
+    // the differences are exact in the unsigned type, while keys above 2^53
+    // are not exact as doubles. lo < key <= hi, so the ratio is in (0, 1]
+    // besides rounding, and m is clamped anyway
+    U d = (U)key - (U)lo, r = (U)hi - (U)lo;
+    size_t m = *begin + (size_t)((long double)d / r * (*end - 1 - *begin));
+    m = std::min(std::max(m, *begin), *end - 1);
+    if (keys[m] < key) {
+      *begin = m + 1;
+    } else {
+      *end = m + 1;
+    }
+  }
+  return false;
+}
 
-  // drop the unmatched tail of src
-  src_key = std::lower_bound(src_key, src_key_end, *dst_key);
-  src_val += (src_key - (src_key_end - src_len)) * k;
+template <typename K>
+inline bool Interpolate(const K* keys, size_t* begin, size_t* end, K key,
+                        std::false_type /* integral */) {
+  return false;
+}
 
-  if (dst_len <= grainsize) {
-    while (dst_key != dst_key_end && src_key != src_key_end) {
-      if (*src_key < *dst_key) {
-        ++ src_key; src_val += k;
-      } else {
-        if (!(*dst_key < *src_key)) {
-          for (int i = 0; i < k; ++i) {
-            AssignOp(dst_val[i], src_val[i], op);
-          }
-          ++ src_key; src_val += k;
-          *n += k;
-        }
-        ++ dst_key; dst_val += k;
+// Returns the first position in [begin, end) whose key is not less than
+// "key". Integer keys are searched by a few interpolation steps, and then a
+// binary search
+template <typename K>
+inline size_t Search(const K* keys, size_t begin, size_t end, K key) {
+  if (Interpolate(keys, &begin, &end, key, std::is_integral<K>())) return begin;
+  return std::lower_bound(keys + begin, keys + end, key) - keys;
+}
+
+// Returns the first position in [begin, end) whose key is not less than
+// "key", by an exponential search from "begin" followed by Search
+template <typename K>
+inline size_t Gallop(const K* keys, size_t begin, size_t end, K key) {
+  size_t lo = begin, hi = begin, step = 1;
+  while (hi < end && keys[hi] < key) {
+    lo = hi + 1;
+    hi += step;
+    step <<= 1;
+  }
+  return Search(keys, lo, std::min(hi, end), key);
+}
+
+// the sequential implementation, see comments bellow. returns the number of
+// matched values
+template <typename K, typename V, AssignOpType op>
+size_t OrderedMatch(
+    const K* src_key, size_t src_len, const V* src_val,
+    const K* dst_key, size_t dst_len, V* dst_val, int k) {
+  size_t n = 0;
+  // search in the larger one if the sizes are skewed, so the cost is
+  // O(min(src_len, dst_len) * log(max(src_len, dst_len)))
+  const size_t kSkew = 16;
+  if (src_len > dst_len * kSkew) {
+    size_t i = 0;
+    for (size_t j = 0; j < dst_len && i < src_len; ++j) {
+      i = Gallop(src_key, i, src_len, dst_key[j]);
+      if (i == src_len || dst_key[j] < src_key[i]) continue;
+      for (int l = 0; l < k; ++l) {
+        AssignOp<op>(dst_val[j * k + l], src_val[i * k + l]);
       }
+      n += k;
+      ++ i;
+    }
+  } else if (dst_len > src_len * kSkew) {
+    size_t j = 0;
+    for (size_t i = 0; i < src_len && j < dst_len; ++i) {
+      j = Gallop(dst_key, j, dst_len, src_key[i]);
+      if (j == dst_len || src_key[i] < dst_key[j]) continue;
+      for (int l = 0; l < k; ++l) {
+        AssignOp<op>(dst_val[j * k + l], src_val[i * k + l]);
+      }
+      n += k;
+      ++ j;
     }
   } else {
-    std::thread thr(
-        ParallelOrderedMatch<K,V>, src_key, src_key_end, src_val,
-        dst_key, dst_key + dst_len / 2, dst_val,
-        k, op, grainsize, n);
-    size_t m = 0;
-    ParallelOrderedMatch<K,V>(
-        src_key, src_key_end, src_val,
-        dst_key + dst_len / 2, dst_key_end, dst_val + ( dst_len / 2 ) * k,
-        k, op, grainsize, &m);
-    thr.join();
-    *n += m;
+    // a merge join, which advances without branches
+    size_t i = 0, j = 0;
+    while (i < src_len && j < dst_len) {
+      K a = src_key[i], b = dst_key[j];
+      if (!(a < b) && !(b < a)) {
+        for (int l = 0; l < k; ++l) {
+          AssignOp<op>(dst_val[j * k + l], src_val[i * k + l]);
+        }
+        n += k;
+      }
+      i += !(b < a);
+      j += !(a < b);
+    }
   }
+  return n;
 }
 
+// the parallel implementation. one of src and dst is divided into parts
+// evenly, and the other one is divided at the same keys by binary search. the
+// parts run on ParallelPool.
+//
+// if the sizes are skewed, the cost is about the size of the smaller one times
+// the cost of a search in the larger one, so the smaller one is divided.
+// otherwise, the cost is the total size, and the larger one is divided
+template <typename K, typename V, AssignOpType op>
+size_t ParallelOrderedMatch(
+    const K* src_key, size_t src_len, const V* src_val,
+    const K* dst_key, size_t dst_len, V* dst_val, int k, int num_threads) {
+  if (src_len == 0 || dst_len == 0) return 0;
+  const size_t kSkew = 16;
+  size_t min_len = std::min(src_len, dst_len);
+  bool skewed = std::max(src_len, dst_len) > min_len * kSkew;
+  // not worth parallelizing a small one. count a search as kSkew steps
+  const size_t kMinPart = 1 << 16;
+  size_t cost = skewed ? min_len * kSkew : src_len + dst_len;
+  int np = (int)std::min((size_t)num_threads, cost * k / kMinPart);
+  if (np <= 1) {
+    return OrderedMatch<K, V, op>(
+        src_key, src_len, src_val, dst_key, dst_len, dst_val, k);
+  }
+
+  bool divide_src = skewed ? src_len < dst_len : src_len > dst_len;
+  std::vector<size_t> src_pos(np + 1), dst_pos(np + 1);
+  src_pos[np] = src_len; dst_pos[np] = dst_len;
+  for (int p = 1; p < np; ++p) {
+    if (divide_src) {
+      src_pos[p] = src_len * p / np;
+      dst_pos[p] = std::lower_bound(
+          dst_key, dst_key + dst_len, src_key[src_pos[p]]) - dst_key;
+    } else {
+      dst_pos[p] = dst_len * p / np;
+      src_pos[p] = std::lower_bound(
+          src_key, src_key + src_len, dst_key[dst_pos[p]]) - src_key;
+    }
+  }
+
+  std::vector<size_t> matched(np);
+  ParallelPool::instance().Run(np, [&](int p) {
+      size_t s = src_pos[p], d = dst_pos[p];
+      matched[p] = OrderedMatch<K, V, op>(
+          src_key + s, src_pos[p+1] - s, src_val + s * k,
+          dst_key + d, dst_pos[p+1] - d, dst_val + d * k, k);
+    });
+  size_t n = 0;
+  for (size_t m : matched) n += m;
+  return n;
+}
 
 // Merge "src_val" into "dst_val" according to the keys by:
 //
@@ -73,13 +184,25 @@ size_t ParallelOrderedMatch(
     CHECK_EQ(dst_val->size(), dst_key.size()*k);
   }
   SizeR range = dst_key.FindRange(src_key.range());
-  size_t grainsize = std::max(range.size() * k / num_threads + 5, (size_t)1024*1024);
-  size_t n = 0;
-  ParallelOrderedMatch<K, V>(
-      src_key.begin(), src_key.end(), src_val.begin(),
-      dst_key.begin() + range.begin(), dst_key.begin() + range.end(),
-      dst_val->begin() + range.begin()*k, k, op, grainsize, &n);
-  return n;
+  const K* dk = dst_key.begin() + range.begin();
+  V* dv = dst_val->begin() + range.begin() * k;
+  size_t dn = range.size();
+#define PS_ORDERED_MATCH_CASE(OP)                                       \
+  case AssignOpType::OP:                                                \
+    return ParallelOrderedMatch<K, V, AssignOpType::OP>(                \
+        src_key.begin(), src_key.size(), src_val.begin(),               \
+        dk, dn, dv, k, num_threads);
+  switch (op) {
+    PS_ORDERED_MATCH_CASE(ASSIGN);
+    PS_ORDERED_MATCH_CASE(PLUS);
+    PS_ORDERED_MATCH_CASE(MINUS);
+    PS_ORDERED_MATCH_CASE(TIMES);
+    PS_ORDERED_MATCH_CASE(DIVIDE);
+    default:
+      CHECK(false) << "unsupported assign op " << op;
+  }
+#undef PS_ORDERED_MATCH_CASE
+  return 0;
 }
 
 // join key-value pairs. use the assigement operator "op" to solve conflicts. it
@@ -97,18 +220,18 @@ void ParallelUnion(
     int num_threads = FLAGS_num_threads) {
 
   // join keys
-  *CHECK_NOTNULL(joined_key) = key1.setUnion(key2);
+  *CHECK_NOTNULL(joined_key) = key1.SetUnion(key2);
   CHECK_NOTNULL(joined_val)->resize(0);
 
   // merge val1
   auto n1 = ParallelOrderedMatch<K,V>(
-      key1, val1, *joined_key, joined_val, num_threads);
-  CHECK_EQ(n1, key1.size());
+      key1, val1, *joined_key, joined_val, k, op, num_threads);
+  CHECK_EQ(n1, key1.size() * k);
 
   // merge val2
   auto n2 = ParallelOrderedMatch<K,V>(
-      key2, val2, *joined_key, joined_val, num_threads);
-  CHECK_EQ(n2, key2.size());
+      key2, val2, *joined_key, joined_val, k, op, num_threads);
+  CHECK_EQ(n2, key2.size() * k);
 }
 
 } // namespace PS
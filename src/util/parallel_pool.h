@@ -0,0 +1,105 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include "util/common.h"
+namespace PS {
+
+/**
+ * @brief A process-wide pool of -num_threads threads for data-parallel loops,
+ * so a short parallel loop does not pay for creating threads.
+ *
+ * Run blocks until all parts are done, and the calling thread runs parts too,
+ * so nested or concurrent calls always make progress.
+ */
+class ParallelPool {
+ public:
+  SINGLETON(ParallelPool);
+  ~ParallelPool() {
+    {
+      Lock l(mu_);
+      done_ = true;
+    }
+    cond_.notify_all();
+    for (auto& t : workers_) t.join();
+  }
+
+  /// @brief Calls func(i) for i in [0, n) in parallel
+  void Run(int n, const std::function<void(int)>& func) {
+    if (n <= 0) return;
+    if (n == 1) { func(0); return; }
+    auto job = std::make_shared<Job>(&func, n);
+    {
+      Lock l(mu_);
+      for (int i = 1; i < n; ++i) tasks_.push_back(Task(job, i));
+    }
+    cond_.notify_all();
+    RunTask(Task(job, 0));
+
+    // help others until my parts are done
+    while (job->remain > 0) {
+      Task task;
+      if (TryPop(&task)) {
+        RunTask(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lk(job->mu);
+      job->cond.wait(lk, [&job]{ return job->remain == 0; });
+    }
+  }
+
+ private:
+  ParallelPool() {
+    for (int i = 0; i < std::max(FLAGS_num_threads, 1); ++i) {
+      workers_.push_back(std::thread(&ParallelPool::Work, this));
+    }
+  }
+
+  struct Job {
+    Job(const std::function<void(int)>* f, int n) : func(f), remain(n) { }
+    const std::function<void(int)>* func;
+    std::atomic<int> remain;
+    std::mutex mu;
+    std::condition_variable cond;
+  };
+  typedef std::pair<std::shared_ptr<Job>, int> Task;
+
+  static void RunTask(const Task& task) {
+    auto& job = task.first;
+    (*job->func)(task.second);
+    if (-- job->remain == 0) {
+      Lock l(job->mu);
+      job->cond.notify_all();
+    }
+  }
+
+  bool TryPop(Task* task) {
+    Lock l(mu_);
+    if (tasks_.empty()) return false;
+    *task = tasks_.front();
+    tasks_.pop_front();
+    return true;
+  }
+
+  void Work() {
+    while (true) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lk(mu_);
+        cond_.wait(lk, [this]{ return done_ || !tasks_.empty(); });
+        if (done_) return;
+        task = tasks_.front();
+        tasks_.pop_front();
+      }
+      RunTask(task);
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::deque<Task> tasks_;
+  bool done_ = false;
+  std::mutex mu_;
+  std::condition_variable cond_;
+  DISALLOW_COPY_AND_ASSIGN(ParallelPool);
+};
+
+} // namespace PS
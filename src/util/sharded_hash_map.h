@@ -0,0 +1,220 @@
+#pragma once
+#include "util/common.h"
+#include "util/integral_types.h"
+namespace PS {
+
+/**
+ * @brief A hash map from integer keys to entries, using Robin Hood open
+ * addressing with entries stored inline in the slots.
+ *
+ * Keys are partitioned into shards by their hash, and each shard has a lock.
+ * Different shards can be accessed by different threads concurrently, see
+ * Batch, and the accesses to the same shard are serialized.
+ *
+ * An entry is default constructed when its key is inserted, and is moved when
+ * the table grows or a slot is taken by another key. Pointers to entries are
+ * invalidated by the next insertion into the same shard, so the ones returned
+ * by operator[] and Find are only valid if no other thread inserts keys.
+ *
+ * @tparam K an integral key type
+ * @tparam E the entry type
+ */
+template <typename K, typename E>
+class ShardedHashMap {
+ public:
+  /**
+   * @param num_shards the number of shards, rounded up to a power of 2
+   */
+  explicit ShardedHashMap(int num_shards = 16) {
+    int n = 1;
+    while (n < num_shards) n <<= 1;
+    shards_.resize(n);
+    locks_ = std::vector<std::mutex>(n);
+    shard_bits_ = 0;
+    while ((1 << shard_bits_) < n) ++ shard_bits_;
+  }
+  ~ShardedHashMap() { }
+
+  /// @brief Returns the entry of "key", inserts one if not found
+  E& operator[](K key) {
+    uint64 h = Hash(key);
+    int s = ShardOfHash(h);
+    Lock l(locks_[s]);
+    return shards_[s].Insert(key, h);
+  }
+
+  /// @brief Returns the entry of "key", or nullptr if not found
+  E* Find(K key) {
+    uint64 h = Hash(key);
+    int s = ShardOfHash(h);
+    Lock l(locks_[s]);
+    return shards_[s].Find(key, h);
+  }
+
+  /// @brief Returns the number of keys
+  size_t size() const {
+    size_t n = 0;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      Lock l(locks_[i]);
+      n += shards_[i].size();
+    }
+    return n;
+  }
+
+  void clear() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      Lock l(locks_[i]);
+      shards_[i].clear();
+    }
+  }
+
+  /// @brief Calls func(key, entry) for every key. A shard is locked while it
+  /// is visited, so the keys inserted meanwhile may or may not be visited
+  template <typename F> void ForEach(F func) {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      Lock l(locks_[i]);
+      shards_[i].ForEach(func);
+    }
+  }
+
+  int num_shards() const { return (int)shards_.size(); }
+
+  /**
+   * @brief Calls func(i, &entry) for every keys[i], and inserts the ones not
+   * found. The slots of the next keys are prefetched while processing the
+   * current one, which hides most of the cache misses of a large table.
+   *
+   * The shards are divided into "num_parts" parts, and only the keys in the
+   * "part"-th one are processed. So "num_parts" threads can process a batch
+   * together without conflicts, each with a different "part". The shards of
+   * the part are locked, in order, until all keys are processed, so "func"
+   * is never called on the same key by two threads at the same time.
+   */
+  template <typename F>
+  void Batch(const K* keys, size_t n, F func, int part = 0, int num_parts = 1) {
+    CHECK_GE(part, 0); CHECK_LT(part, num_parts);
+    // shards in [begin, end)
+    int begin = num_shards() * part / num_parts;
+    int end = num_shards() * (part + 1) / num_parts;
+    if (begin == end) return;
+    std::vector<std::unique_lock<std::mutex>> lks;
+    for (int s = begin; s < end; ++s) {
+      lks.push_back(std::unique_lock<std::mutex>(locks_[s]));
+    }
+    const size_t kAhead = 16;
+    uint64 hash[kAhead];
+    for (size_t i = 0; i < n + kAhead; ++i) {
+      // process keys[i - kAhead], then prefetch keys[i] into its place
+      if (i >= kAhead) {
+        size_t j = i - kAhead;
+        uint64 h = hash[j % kAhead];
+        int s = ShardOfHash(h);
+        if (s >= begin && s < end) func(j, &shards_[s].Insert(keys[j], h));
+      }
+      if (i < n) {
+        uint64 h = Hash(keys[i]);
+        hash[i % kAhead] = h;
+        int s = ShardOfHash(h);
+        if (s >= begin && s < end) shards_[s].Prefetch(h);
+      }
+    }
+  }
+
+ private:
+  // the finalizer of MurmurHash3
+  static uint64 Hash(K key) {
+    uint64 h = (uint64)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+  // the high bits choose the shard, the low ones the slot
+  int ShardOfHash(uint64 h) const {
+    return shard_bits_ == 0 ? 0 : (int)(h >> (64 - shard_bits_));
+  }
+
+  class Shard {
+   public:
+    Shard() { }
+    size_t size() const { return size_; }
+
+    void clear() { slots_.clear(); mask_ = 0; size_ = 0; }
+
+    void Prefetch(uint64 h) const {
+      if (!slots_.empty()) __builtin_prefetch(&slots_[h & mask_]);
+    }
+
+    E* Find(K key, uint64 h) {
+      if (slots_.empty()) return nullptr;
+      size_t i = h & mask_;
+      for (uint32 d = 1; slots_[i].dist >= d; ++d, i = (i + 1) & mask_) {
+        if (slots_[i].key == key) return &slots_[i].value;
+      }
+      return nullptr;
+    }
+
+    E& Insert(K key, uint64 h) {
+      E* e = Find(key, h);
+      if (e) return *e;
+      if ((size_ + 1) * 8 > slots_.size() * 7) Grow();
+      ++ size_;
+      Slot cur;
+      cur.key = key;
+      cur.dist = 1;
+      size_t pos = (size_t)-1;
+      size_t i = h & mask_;
+      while (true) {
+        Slot& s = slots_[i];
+        if (s.dist == 0) {
+          s = std::move(cur);
+          return slots_[pos == (size_t)-1 ? i : pos].value;
+        }
+        if (s.dist < cur.dist) {
+          // take the slot from the richer one
+          std::swap(s, cur);
+          if (pos == (size_t)-1) pos = i;
+        }
+        ++ cur.dist;
+        i = (i + 1) & mask_;
+      }
+    }
+
+    template <typename F> void ForEach(F& func) {
+      for (auto& s : slots_) if (s.dist) func(s.key, s.value);
+    }
+
+   private:
+    struct Slot {
+      K key;
+      // the probe distance plus 1, 0 means empty
+      uint32 dist = 0;
+      E value = E();
+    };
+
+    void Grow() {
+      std::vector<Slot> old;
+      old.swap(slots_);
+      slots_.resize(std::max(old.size() * 2, (size_t)16));
+      mask_ = slots_.size() - 1;
+      size_ = 0;
+      for (auto& s : old) {
+        if (s.dist) Insert(s.key, Hash(s.key)) = std::move(s.value);
+      }
+    }
+
+    std::vector<Slot> slots_;
+    size_t mask_ = 0;
+    size_t size_ = 0;
+  };
+
+  std::vector<Shard> shards_;
+  // locks_[i] protects shards_[i]
+  mutable std::vector<std::mutex> locks_;
+  int shard_bits_;
+  DISALLOW_COPY_AND_ASSIGN(ShardedHashMap);
+};
+
+} // namespace PS
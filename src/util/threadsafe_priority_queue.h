@@ -0,0 +1,67 @@
+#pragma once
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include "util/integral_types.h"
+namespace PS {
+
+/**
+ * @brief A thread-safe queue which pops the element with the largest priority
+ * first. Elements with the same priority are popped in the order they were
+ * pushed.
+ */
+template<typename T> class ThreadsafePriorityQueue {
+ public:
+  ThreadsafePriorityQueue() { }
+
+  void push(T value, int priority) {
+    std::lock_guard<std::mutex> lk(mu_);
+    queue_.push(Entry(std::move(value), priority, seq_ ++));
+    cond_.notify_all();
+  }
+
+  void wait_and_pop(T& value) {
+    std::unique_lock<std::mutex> lk(mu_);
+    cond_.wait(lk, [this]{ return !queue_.empty(); });
+    value = std::move(const_cast<Entry&>(queue_.top()).value);
+    queue_.pop();
+  }
+
+  bool try_pop(T& value) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (queue_.empty()) return false;
+    value = std::move(const_cast<Entry&>(queue_.top()).value);
+    queue_.pop();
+    return true;
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return queue_.size();
+  }
+
+  bool empty() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return queue_.empty();
+  }
+
+ private:
+  struct Entry {
+    Entry(T v, int p, uint64 s) : value(std::move(v)), priority(p), seq(s) { }
+    T value;
+    int priority;
+    uint64 seq;
+    // std::priority_queue pops the largest one
+    bool operator<(const Entry& other) const {
+      return priority < other.priority ||
+          (priority == other.priority && seq > other.seq);
+    }
+  };
+  mutable std::mutex mu_;
+  std::priority_queue<Entry> queue_;
+  std::condition_variable cond_;
+  uint64 seq_ = 0;
+};
+
+} // namespace PS